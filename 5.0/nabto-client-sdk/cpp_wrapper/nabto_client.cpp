@@ -2,6 +2,36 @@
 #include <nabto/nabto_client.h>
 #include <nabto/nabto_client_experimental.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#ifdef NABTO_CLIENT_USDT
+// USDT probes, see tracing/README.md. Each probe has a semaphore which
+// the tracer increments while the probe is attached, such that the
+// probe arguments are only evaluated when the probe is traced.
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define NABTO_CLIENT_PROBE_SEMAPHORE(name) \
+    __extension__ volatile unsigned short nabto_client_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+NABTO_CLIENT_PROBE_SEMAPHORE(connect);
+NABTO_CLIENT_PROBE_SEMAPHORE(stream_open);
+NABTO_CLIENT_PROBE_SEMAPHORE(stream_read);
+NABTO_CLIENT_PROBE_SEMAPHORE(stream_write);
+NABTO_CLIENT_PROBE_SEMAPHORE(coap_execute);
+NABTO_CLIENT_PROBE_SEMAPHORE(future_resolved);
+#define NABTO_CLIENT_PROBE_ENABLED(name) __builtin_expect(nabto_client_##name##_semaphore, 0)
+#define NABTO_CLIENT_PROBE2(name, a1, a2) do { if (NABTO_CLIENT_PROBE_ENABLED(name)) { DTRACE_PROBE2(nabto_client, name, a1, a2); } } while (0)
+#define NABTO_CLIENT_PROBE3(name, a1, a2, a3) do { if (NABTO_CLIENT_PROBE_ENABLED(name)) { DTRACE_PROBE3(nabto_client, name, a1, a2, a3); } } while (0)
+#else
+#define NABTO_CLIENT_PROBE2(name, a1, a2)
+#define NABTO_CLIENT_PROBE3(name, a1, a2, a3)
+#endif
+
 namespace nabto {
 namespace client {
 
@@ -68,12 +98,14 @@ class FutureBufferImpl : public FutureBuffer, public std::enable_shared_from_thi
     {
         nabto_client_future_wait(future_);
         ended_ = true;
+        NABTO_CLIENT_PROBE3(future_resolved, future_, nabto_client_future_error_code(future_), *transferred_);
         return getResult();
     }
     static void doCallback(NabtoClientFuture* future, NabtoClientError ec, void* data)
     {
         FutureBufferImpl* self = (FutureBufferImpl*)data;
         self->ended_ = true;
+        NABTO_CLIENT_PROBE3(future_resolved, future, ec, *self->transferred_);
         self->cb_->run(Status(ec));
         self->selfReference_ = nullptr;
     }
@@ -252,6 +284,7 @@ class FutureVoidImpl : public FutureVoid, public std::enable_shared_from_this<Fu
     {
         if (!ended_) {
             auto c = std::make_shared<FutureVoidImpl>(future_, data_);
+            c->resolved_ = resolved_;
             c->callback(std::make_shared<CallbackFunction>([](Status){ /* do nothing */ }));
         } else {
             nabto_client_future_free(future_);
@@ -261,6 +294,8 @@ class FutureVoidImpl : public FutureVoid, public std::enable_shared_from_this<Fu
     void waitForResult() {
         nabto_client_future_wait(future_);
         ended_ = true;
+        NABTO_CLIENT_PROBE3(future_resolved, future_, nabto_client_future_error_code(future_), 0);
+        resolved(nabto_client_future_error_code(future_));
         return getResult();
     }
 
@@ -268,10 +303,19 @@ class FutureVoidImpl : public FutureVoid, public std::enable_shared_from_this<Fu
     {
         FutureVoidImpl* self = (FutureVoidImpl*)data;
         self->ended_ = true;
+        NABTO_CLIENT_PROBE3(future_resolved, future, ec, 0);
+        self->resolved(ec);
         self->cb_->run(Status(ec));
         self->selfReference_ = nullptr;
     }
 
+    /**
+     * Invoke hook once when the future is resolved, used for tracing.
+     */
+    void onResolved(std::function<void (int ec)> hook) {
+        resolved_ = hook;
+    }
+
     //bool waitFor(int milliseconds) = 0;
     void callback(std::shared_ptr<FutureCallback> cb)
     {
@@ -297,9 +341,33 @@ class FutureVoidImpl : public FutureVoid, public std::enable_shared_from_this<Fu
     std::shared_ptr<Buffer> data_;
     std::shared_ptr<FutureVoidImpl> selfReference_;
     std::shared_ptr<FutureCallback> cb_;
+    std::function<void (int ec)> resolved_;
     bool ended_ = false;
+
+    void resolved(int ec) {
+        if (resolved_) {
+            auto hook = resolved_;
+            resolved_ = nullptr;
+            hook(ec);
+        }
+    }
 };
 
+/**
+ * Start a span, the returned function ends it.
+ */
+static std::function<void (int ec)> startSpan(std::shared_ptr<Tracer> tracer, const std::string& name, const std::string& detail)
+{
+    TraceSpan span;
+    span.name = name;
+    span.detail = detail;
+    span.start = std::chrono::steady_clock::now();
+    return [tracer, span](int ec) mutable {
+        span.end = std::chrono::steady_clock::now();
+        span.errorCode = ec;
+        tracer->span(span);
+    };
+}
 
 class MdnsResultImpl : public MdnsResult {
  public:
@@ -378,8 +446,8 @@ class MdnsResolverImpl : public MdnsResolver {
 
 class CoapImpl : public Coap {
  public:
-    CoapImpl(NabtoClient* context, NabtoClientCoap* coap)
-        : context_(context)
+    CoapImpl(NabtoClient* context, NabtoClientCoap* coap, std::shared_ptr<Tracer> tracer, const std::string& detail)
+        : context_(context), tracer_(tracer), detail_(detail)
     {
         request_ = coap;
     }
@@ -387,13 +455,13 @@ class CoapImpl : public Coap {
         nabto_client_coap_free(request_);
     };
 
-    static std::shared_ptr<CoapImpl> create(NabtoClient* context, NabtoClientConnection* connection, const std::string& method, const std::string& path)
+    static std::shared_ptr<CoapImpl> create(NabtoClient* context, NabtoClientConnection* connection, const std::string& method, const std::string& path, std::shared_ptr<Tracer> tracer)
     {
         auto request_ = nabto_client_coap_new(connection, method.c_str(), path.c_str());
         if (!request_) {
             return nullptr;
         }
-        return std::make_shared<CoapImpl>(context, request_);
+        return std::make_shared<CoapImpl>(context, request_, tracer, method + " " + path);
     }
 
     void setRequestPayload(int contentFormat, std::shared_ptr<Buffer> payload)
@@ -408,6 +476,10 @@ class CoapImpl : public Coap {
     std::shared_ptr<FutureVoid> execute()
     {
         auto future = std::make_shared<FutureVoidImpl>(context_);
+        if (tracer_) {
+            future->onResolved(startSpan(tracer_, "coap_execute", detail_));
+        }
+        NABTO_CLIENT_PROBE3(coap_execute, request_, future->getFuture(), detail_.c_str());
         nabto_client_coap_execute(request_, future->getFuture());
         return future;
     }
@@ -447,13 +519,15 @@ class CoapImpl : public Coap {
  private:
     NabtoClientCoap* request_;
     NabtoClient* context_;
+    std::shared_ptr<Tracer> tracer_;
+    std::string detail_;
 };
 
 
 class StreamImpl : public Stream {
  public:
-    StreamImpl(NabtoClientConnection* connection, NabtoClient* context)
-        : context_(context)
+    StreamImpl(NabtoClientConnection* connection, NabtoClient* context, std::shared_ptr<Tracer> tracer)
+        : context_(context), tracer_(tracer)
     {
         stream_ = nabto_client_stream_new(connection);
     }
@@ -463,6 +537,10 @@ class StreamImpl : public Stream {
     std::shared_ptr<FutureVoid> open(uint32_t contentType)
     {
         auto future = std::make_shared<FutureVoidImpl>(context_);
+        if (tracer_) {
+            future->onResolved(startSpan(tracer_, "stream_open", std::to_string(contentType)));
+        }
+        NABTO_CLIENT_PROBE3(stream_open, stream_, future->getFuture(), contentType);
         nabto_client_stream_open(stream_, future->getFuture(), contentType);
         return future;
     }
@@ -471,6 +549,7 @@ class StreamImpl : public Stream {
         auto data = std::make_shared<BufferOut>(n);
         auto transferred = std::make_shared<size_t>();
         auto future = std::make_shared<FutureBufferImpl>(context_,data, transferred);
+        NABTO_CLIENT_PROBE3(stream_read, stream_, future->getFuture(), n);
         nabto_client_stream_read_all(stream_, future->getFuture(), data->data(), data->size(), transferred.get());
         return future;
     }
@@ -479,12 +558,14 @@ class StreamImpl : public Stream {
         auto data = std::make_shared<BufferOut>(max);
         auto transferred = std::make_shared<size_t>();
         auto future = std::make_shared<FutureBufferImpl>(context_, data, transferred);
+        NABTO_CLIENT_PROBE3(stream_read, stream_, future->getFuture(), max);
         nabto_client_stream_read_some(stream_, future->getFuture(), data->data(), data->size(), transferred.get());
         return future;
     }
     std::shared_ptr<FutureVoid> write(std::shared_ptr<Buffer> data)
     {
         auto future = std::make_shared<FutureVoidImpl>(context_, data);
+        NABTO_CLIENT_PROBE3(stream_write, stream_, future->getFuture(), data->size());
         nabto_client_stream_write(stream_, future->getFuture(), data->data(), data->size());
         return future;
     }
@@ -497,6 +578,7 @@ class StreamImpl : public Stream {
  private:
     NabtoClientStream* stream_;
     NabtoClient* context_;
+    std::shared_ptr<Tracer> tracer_;
 };
 
 class TcpTunnelImpl : public TcpTunnel {
@@ -562,8 +644,8 @@ class ConnectionEventsListenerImpl : public ConnectionEventsListener {
 
 class ConnectionImpl : public Connection {
  public:
-    ConnectionImpl(NabtoClient* context)
-        : context_(context)
+    ConnectionImpl(NabtoClient* context, std::shared_ptr<Tracer> tracer)
+        : context_(context), tracer_(tracer)
     {
         connection_ = nabto_client_connection_new(context);
     }
@@ -577,6 +659,7 @@ class ConnectionImpl : public Connection {
         if (ec) {
             throw NabtoException(ec);
         }
+        productId_ = productId;
     }
     void setDeviceId(const std::string& deviceId)
     {
@@ -584,6 +667,7 @@ class ConnectionImpl : public Connection {
         if (ec) {
             throw NabtoException(ec);
         }
+        deviceId_ = deviceId;
     }
     void setServerKey(const std::string& serverKey)
     {
@@ -630,6 +714,38 @@ class ConnectionImpl : public Connection {
             throw NabtoException(ec);
         }
     }
+    void setOptions(const std::string& options)
+    {
+        NabtoClientError ec = nabto_client_connection_set_options(connection_, options.c_str());
+        if (ec) {
+            throw NabtoException(ec);
+        }
+    }
+
+    std::string getOptions()
+    {
+        char* options;
+        auto ec = nabto_client_connection_get_options(connection_, &options);
+        if (ec) {
+            throw NabtoException(ec);
+        }
+        auto str = std::string(options);
+        nabto_client_string_free(options);
+        return str;
+    }
+
+    std::string getInfo()
+    {
+        char* info;
+        auto ec = nabto_client_connection_get_info(connection_, &info);
+        if (ec) {
+            throw NabtoException(ec);
+        }
+        auto str = std::string(info);
+        nabto_client_string_free(info);
+        return str;
+    }
+
     std::string getDeviceFingerprintHex()
     {
         char* f;
@@ -681,12 +797,16 @@ class ConnectionImpl : public Connection {
     std::shared_ptr<FutureVoid> connect()
     {
         auto future = std::make_shared<FutureVoidImpl>(context_);
+        if (tracer_) {
+            future->onResolved(startSpan(tracer_, "connect", productId_ + "." + deviceId_));
+        }
+        NABTO_CLIENT_PROBE2(connect, connection_, future->getFuture());
         nabto_client_connection_connect(connection_, future->getFuture());
         return future;
     }
     std::shared_ptr<Stream> createStream()
     {
-        return std::make_shared<StreamImpl>(connection_, context_);
+        return std::make_shared<StreamImpl>(connection_, context_, tracer_);
     }
     std::shared_ptr<FutureVoid> close()
     {
@@ -697,7 +817,7 @@ class ConnectionImpl : public Connection {
 
     std::shared_ptr<Coap> createCoap(const std::string& method, const std::string& path)
     {
-        return CoapImpl::create(context_, connection_, method, path);
+        return CoapImpl::create(context_, connection_, method, path, tracer_);
     }
 
     std::shared_ptr<TcpTunnel> createTcpTunnel()
@@ -715,6 +835,10 @@ class ConnectionImpl : public Connection {
  private:
     NabtoClientConnection* connection_;
     NabtoClient* context_;
+    std::shared_ptr<Tracer> tracer_;
+    // for trace spans
+    std::string productId_;
+    std::string deviceId_;
 };
 
 class LogMessageImpl : public LogMessage {
@@ -746,17 +870,145 @@ class LoggerProxy {
     std::shared_ptr<Logger> logger_;
 };
 
+class PrivateKeyPool {
+ public:
+    PrivateKeyPool(NabtoClient* context)
+        : context_(context)
+    {
+    }
+    ~PrivateKeyPool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+        cond_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void setDepth(size_t depth) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            depth_ = depth;
+            while (keys_.size() > depth_) {
+                keys_.pop_back();
+            }
+            if (depth_ > 0 && !thread_.joinable()) {
+                thread_ = std::thread(&PrivateKeyPool::run, this);
+            }
+        }
+        cond_.notify_all();
+    }
+
+    /**
+     * Take up to count keys from the pool.
+     */
+    std::vector<std::string> take(size_t count) {
+        std::vector<std::string> keys;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (keys.size() < count && !keys_.empty()) {
+                keys.push_back(std::move(keys_.front()));
+                keys_.pop_front();
+            }
+            stats_.poolHits += keys.size();
+            stats_.poolMisses += count - keys.size();
+        }
+        if (!keys.empty()) {
+            cond_.notify_all();
+        }
+        return keys;
+    }
+
+    PrivateKeyPoolStats getStats() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        PrivateKeyPoolStats stats = stats_;
+        stats.available = keys_.size();
+        return stats;
+    }
+
+    static std::string createPrivateKey(NabtoClient* context) {
+        char* privateKey;
+        auto ec = nabto_client_create_private_key(context, &privateKey);
+        if (ec) {
+            throw NabtoException(ec);
+        }
+        auto ret = std::string(privateKey);
+        nabto_client_string_free(privateKey);
+        return ret;
+    }
+
+ private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            cond_.wait(lock, [this](){ return stopped_ || keys_.size() < depth_; });
+            if (stopped_) {
+                return;
+            }
+            lock.unlock();
+            auto start = std::chrono::steady_clock::now();
+            std::string key;
+            bool ok = true;
+            try {
+                key = createPrivateKey(context_);
+            } catch (NabtoException& e) {
+                ok = false;
+            }
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            lock.lock();
+            if (!ok) {
+                // Do not spin on a persistent error, callers fall
+                // back to generating keys themselves.
+                cond_.wait_for(lock, std::chrono::seconds(1));
+                continue;
+            }
+            stats_.generated++;
+            stats_.generationMilliseconds += elapsed.count();
+            if (keys_.size() < depth_) {
+                keys_.push_back(std::move(key));
+            }
+        }
+    }
+
+    NabtoClient* context_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::string> keys_;
+    size_t depth_ = 0;
+    bool stopped_ = false;
+    PrivateKeyPoolStats stats_;
+    std::thread thread_;
+};
+
 class ContextImpl : public Context {
  public:
-    ContextImpl() {
-        context_ = nabto_client_new();
+    ContextImpl(size_t workers) {
+        for (size_t i = 0; i < std::max(workers, (size_t)1); i++) {
+            contexts_.push_back(nabto_client_new());
+        }
+        // mdns and key generation does not depend on the connections,
+        // they use the first context.
+        context_ = contexts_.front();
+        privateKeyPool_ = std::make_unique<PrivateKeyPool>(context_);
     }
     ~ContextImpl() {
-        nabto_client_free(context_);
+        // stop the pool thread before the context it uses is freed.
+        privateKeyPool_.reset();
+        for (auto context : contexts_) {
+            nabto_client_free(context);
+        }
     }
 
     std::shared_ptr<Connection> createConnection() {
-        return std::make_shared<ConnectionImpl>(context_);
+        size_t worker = nextWorker_++ % contexts_.size();
+        return std::make_shared<ConnectionImpl>(contexts_[worker], getTracer());
+    }
+
+    std::shared_ptr<Connection> createConnection(const std::string& shardKey) {
+        size_t worker = std::hash<std::string>()(shardKey) % contexts_.size();
+        return std::make_shared<ConnectionImpl>(contexts_[worker], getTracer());
     }
 
     std::shared_ptr<MdnsResolver> createMdnsResolver() {
@@ -765,31 +1017,66 @@ class ContextImpl : public Context {
 
     void setLogger(std::shared_ptr<Logger> logger) {
         // todo test return value.
-        loggerProxy_ = std::make_shared<LoggerProxy>(logger, context_);
+        // Replaced proxies are kept until the contexts are freed, a
+        // log callback on another thread may still be using them.
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (auto context : contexts_) {
+            loggerProxies_.push_back(std::make_shared<LoggerProxy>(logger, context));
+        }
     }
 
     void setLogLevel(const std::string& level) {
-        NabtoClientError ec = nabto_client_set_log_level(context_, level.c_str());
-        if (ec) {
-            throw NabtoException(ec);
+        for (auto context : contexts_) {
+            NabtoClientError ec = nabto_client_set_log_level(context, level.c_str());
+            if (ec) {
+                throw NabtoException(ec);
+            }
         }
     }
 
+    void setTracer(std::shared_ptr<Tracer> tracer) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        tracer_ = tracer;
+    }
+
     std::string createPrivateKey() {
-        char* privateKey;
-        auto ec = nabto_client_create_private_key(context_, &privateKey);
-        if (ec) {
-            throw NabtoException(ec);
+        auto keys = privateKeyPool_->take(1);
+        if (!keys.empty()) {
+            return keys.front();
         }
-        auto ret = std::string(privateKey);
-        nabto_client_string_free(privateKey);
-        return ret;
+        return PrivateKeyPool::createPrivateKey(context_);
+    }
+
+    std::vector<std::string> createPrivateKeys(size_t count) {
+        auto keys = privateKeyPool_->take(count);
+        while (keys.size() < count) {
+            keys.push_back(PrivateKeyPool::createPrivateKey(context_));
+        }
+        return keys;
+    }
+
+    void setPrivateKeyPoolDepth(size_t depth) {
+        privateKeyPool_->setDepth(depth);
+    }
+
+    PrivateKeyPoolStats getPrivateKeyPoolStats() {
+        return privateKeyPool_->getStats();
     }
 
  private:
+    std::vector<NabtoClient*> contexts_;
     NabtoClient* context_;
-    std::shared_ptr<LoggerProxy> loggerProxy_;
+    std::atomic<size_t> nextWorker_{0};
+    // every proxy ever registered, freed after the contexts.
+    std::vector<std::shared_ptr<LoggerProxy> > loggerProxies_;
+    std::unique_ptr<PrivateKeyPool> privateKeyPool_;
+    std::mutex mutex_;
+    std::shared_ptr<Tracer> tracer_;
 
+    std::shared_ptr<Tracer> getTracer() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return tracer_;
+    }
 };
 
 std::string Context::version() {
@@ -798,7 +1085,12 @@ std::string Context::version() {
 
 std::shared_ptr<Context> Context::create()
 {
-    return std::make_shared<ContextImpl>();
+    return std::make_shared<ContextImpl>(1);
+}
+
+std::shared_ptr<Context> Context::create(size_t workers)
+{
+    return std::make_shared<ContextImpl>(workers);
 }
 
 void Future::callback(std::function<void (Status status)> cb)
@@ -6,6 +6,7 @@
 #include <vector>
 #include <exception>
 #include <cstdint>
+#include <chrono>
 
 namespace nabto {
 namespace client {
@@ -84,6 +85,32 @@ class Logger {
     virtual void log(LogMessage message) = 0;
 };
 
+/**
+ * A timed operation. Spans are reported to the Tracer when the
+ * operation has ended.
+ */
+class TraceSpan {
+ public:
+    // connect, stream_open or coap_execute
+    std::string name;
+    // e.g. the method and path of a coap request.
+    std::string detail;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    // 0 if the operation succeeded else the nabto client error code.
+    int errorCode = 0;
+};
+
+class Tracer {
+ public:
+    virtual ~Tracer() {}
+    /**
+     * Called from the thread which observed the end of the operation,
+     * the tracer should not block.
+     */
+    virtual void span(const TraceSpan& span) = 0;
+};
+
 class FutureCallback {
  public:
     virtual ~FutureCallback() { }
@@ -207,6 +234,23 @@ class Connection {
     virtual void addDirectCandidate(const std::string& hostname, uint16_t port) = 0;
     virtual void endOfDirectCandidates() = 0;
 
+    /**
+     * Set connection options from a json document, see
+     * nabto_client_connection_set_options for the available options.
+     */
+    virtual void setOptions(const std::string& options) = 0;
+
+    /**
+     * Get the current connection options as a json document.
+     */
+    virtual std::string getOptions() = 0;
+
+    /**
+     * Get information about the connection as a json document, see
+     * nabto_client_connection_get_info.
+     */
+    virtual std::string getInfo() = 0;
+
 
 
     virtual std::shared_ptr<FutureVoid> connect() = 0;
@@ -217,16 +261,81 @@ class Connection {
     virtual std::shared_ptr<ConnectionEventsListener> createEventsListener() = 0;
 };
 
+class PrivateKeyPoolStats {
+ public:
+    // Number of keys currently ready in the pool.
+    size_t available = 0;
+    // Number of keys generated by the background thread.
+    uint64_t generated = 0;
+    // Total time the background thread has spent generating keys.
+    uint64_t generationMilliseconds = 0;
+    // Keys handed out from the pool.
+    uint64_t poolHits = 0;
+    // Keys generated on the calling thread because the pool was empty.
+    uint64_t poolMisses = 0;
+};
+
 class Context {
  public:
     // shared_ptr as swig does not understand unique_ptr yet.
     static std::shared_ptr<Context> create();
+
+    /**
+     * Create a context which spreads its connections over workers
+     * independent client contexts. Each underlying context has its
+     * own network threads, so the DTLS and stream work of many
+     * connections is not serialized on a single set of threads.
+     */
+    static std::shared_ptr<Context> create(size_t workers);
+
     virtual ~Context() {};
+
+    /**
+     * Create a connection. Connections are assigned to the workers
+     * round robin.
+     */
     virtual std::shared_ptr<Connection> createConnection() = 0;
+
+    /**
+     * Create a connection on the worker selected by the hash of
+     * shardKey, e.g. the product and device id, such that all
+     * connections for a given key use the same worker.
+     */
+    virtual std::shared_ptr<Connection> createConnection(const std::string& shardKey) = 0;
     virtual std::shared_ptr<MdnsResolver> createMdnsResolver() = 0;
+
+    /**
+     * Set the logger of all workers. A replaced logger is kept alive
+     * until the context is destroyed, as a log message may still be
+     * delivered to it.
+     */
     virtual void setLogger(std::shared_ptr<Logger> logger) = 0;
     virtual void setLogLevel(const std::string& level) = 0;
+
+    /**
+     * Report connect, stream open and coap execute timings to the
+     * tracer. Applies to connections created after the tracer is set.
+     */
+    virtual void setTracer(std::shared_ptr<Tracer> tracer) = 0;
+
     virtual std::string createPrivateKey() = 0;
+
+    /**
+     * Create count private keys. Keys are taken from the private key
+     * pool first, the remaining keys are generated on the calling
+     * thread.
+     */
+    virtual std::vector<std::string> createPrivateKeys(size_t count) = 0;
+
+    /**
+     * Pregenerate private keys on a background thread such that
+     * createPrivateKey is a cheap dequeue in the common case. The
+     * pool is refilled up to depth keys. A depth of 0 disables the
+     * pool and discards pregenerated keys.
+     */
+    virtual void setPrivateKeyPoolDepth(size_t depth) = 0;
+    virtual PrivateKeyPoolStats getPrivateKeyPoolStats() = 0;
+
     static std::string version();
 };
 
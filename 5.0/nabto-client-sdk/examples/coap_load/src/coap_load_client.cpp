@@ -0,0 +1,399 @@
+#include <nabto_client.hpp>
+
+#include "json_config.hpp"
+#include "latency_histogram.hpp"
+
+#include <cxxopts.hpp>
+#include <nlohmann/json.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+using json = nlohmann::json;
+
+const static int CONTENT_FORMAT_TEXT_PLAIN = 0;
+const static int CONTENT_FORMAT_APPLICATION_JSON = 50;
+const static int CONTENT_FORMAT_APPLICATION_CBOR = 60; // rfc 7059
+
+/**
+ * A request of the scenario file.
+ */
+struct RequestTemplate {
+    std::string name;
+    std::string method;
+    std::string path;
+    int contentFormat = 0;
+    std::shared_ptr<nabto::client::Buffer> payload;
+    int weight = 1;
+};
+
+struct RequestStats {
+    nabto::common::LatencyHistogram histogram;
+    // responses with a status code of 400 or above
+    uint64_t failedResponses = 0;
+    // requests which failed before a response was received
+    uint64_t transportErrors = 0;
+};
+
+/**
+ * Keeps a number of coap requests in flight on each connection until
+ * the end of the test. A completed request immediately issues the
+ * next request of the scenario on the same connection, the requests
+ * are picked in weighted round robin order.
+ */
+class LoadRunner {
+ public:
+    LoadRunner(std::vector<RequestTemplate> requests, std::chrono::steady_clock::time_point end)
+        : requests_(requests), stats_(requests.size()), end_(end)
+    {
+        for (size_t i = 0; i < requests_.size(); i++) {
+            for (int w = 0; w < requests_[i].weight; w++) {
+                schedule_.push_back(i);
+            }
+        }
+    }
+
+    void start(std::shared_ptr<nabto::client::Connection> connection, int inFlight)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            active_ += inFlight;
+        }
+        for (int i = 0; i < inFlight; i++) {
+            startRequest(connection);
+        }
+    }
+
+    /**
+     * Wait until all requests which were in flight at the end of the
+     * test have completed.
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this](){ return active_ == 0; });
+    }
+
+    const std::vector<RequestStats>& stats() { return stats_; }
+    const std::map<int, uint64_t>& statusCodes() { return statusCodes_; }
+
+ private:
+    void startRequest(std::shared_ptr<nabto::client::Connection> connection)
+    {
+        size_t index = schedule_[next_++ % schedule_.size()];
+        const RequestTemplate& request = requests_[index];
+        std::shared_ptr<nabto::client::Coap> coap;
+        try {
+            coap = connection->createCoap(request.method, request.path);
+            if (request.payload) {
+                coap->setRequestPayload(request.contentFormat, request.payload);
+            }
+        } catch (std::exception& e) {
+            std::cerr << "Could not create coap request " << e.what() << std::endl;
+            requestDone();
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        coap->execute()->callback([this, connection, coap, index, start](nabto::client::Status status) {
+                completed(connection, coap, index, start, status);
+            });
+    }
+
+    void completed(std::shared_ptr<nabto::client::Connection> connection, std::shared_ptr<nabto::client::Coap> coap, size_t index, std::chrono::steady_clock::time_point start, nabto::client::Status status)
+    {
+        auto now = std::chrono::steady_clock::now();
+        int statusCode = 0;
+        if (status.ok()) {
+            try {
+                statusCode = coap->getResponseStatusCode();
+            } catch (std::exception& e) {
+            }
+        }
+        if (now <= end_) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            RequestStats& stats = stats_[index];
+            if (statusCode == 0) {
+                stats.transportErrors++;
+            } else {
+                stats.histogram.record(now - start);
+                statusCodes_[statusCode]++;
+                if (statusCode >= 400) {
+                    stats.failedResponses++;
+                }
+            }
+        }
+        // A request which failed without a response means the
+        // connection is gone, retrying would just spin.
+        if (now < end_ && statusCode != 0) {
+            startRequest(connection);
+        } else {
+            requestDone();
+        }
+    }
+
+    void requestDone()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        active_--;
+        if (active_ == 0) {
+            cond_.notify_all();
+        }
+    }
+
+    std::vector<RequestTemplate> requests_;
+    std::vector<size_t> schedule_;
+    std::atomic<uint64_t> next_{0};
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    int active_ = 0;
+    std::vector<RequestStats> stats_;
+    std::map<int, uint64_t> statusCodes_;
+    std::chrono::steady_clock::time_point end_;
+};
+
+static std::vector<RequestTemplate> load_scenario(const std::string& scenarioFile);
+static std::shared_ptr<nabto::client::Connection> create_connection(std::shared_ptr<nabto::client::Context> context, const json& config);
+static void print_report(const std::vector<RequestTemplate>& requests, LoadRunner& runner, int durationSeconds);
+static void print_json_report(const std::vector<RequestTemplate>& requests, LoadRunner& runner, int durationSeconds);
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("CoAP load", "Keep a number of coap requests in flight against a device and report throughput and latency.");
+
+    options.add_options()
+        ("h,help", "Show help")
+        ("c,config", "Client config file with ProductId, DeviceId, ServerUrl, ServerKey, PrivateKey and DeviceFingerprint as written by the heat_pump_client when pairing", cxxopts::value<std::string>()->default_value("heat_pump_client.json"))
+        ("scenario", "Scenario file with the requests to send", cxxopts::value<std::string>())
+        ("n,connections", "Number of connections", cxxopts::value<int>()->default_value("1"))
+        ("m,in-flight", "Requests in flight per connection", cxxopts::value<int>()->default_value("1"))
+        ("t,duration", "Test duration in seconds", cxxopts::value<int>()->default_value("10"))
+        ("json", "Print the report as json including the histogram buckets")
+        ;
+
+    int connections;
+    int inFlight;
+    int duration;
+    std::string configFile;
+    std::string scenarioFile;
+    bool jsonReport;
+    try {
+        auto result = options.parse(argc, argv);
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            exit(0);
+        }
+        configFile = result["config"].as<std::string>();
+        scenarioFile = result["scenario"].as<std::string>();
+        connections = result["connections"].as<int>();
+        inFlight = result["in-flight"].as<int>();
+        duration = result["duration"].as<int>();
+        jsonReport = result.count("json") > 0;
+    } catch (const cxxopts::OptionException& e) {
+        std::cerr << "Error parsing options: " << e.what() << std::endl;
+        std::cerr << options.help() << std::endl;
+        exit(1);
+    } catch (const std::domain_error& e) {
+        std::cerr << "Error parsing options: " << e.what() << std::endl;
+        std::cerr << options.help() << std::endl;
+        exit(1);
+    }
+    if (connections < 1 || inFlight < 1 || duration < 1) {
+        std::cerr << "connections, in-flight and duration must be positive" << std::endl;
+        exit(1);
+    }
+
+    json config;
+    if (!json_config_load(configFile, config)) {
+        std::cerr << "Could not read config file " << configFile << std::endl;
+        exit(1);
+    }
+
+    std::vector<RequestTemplate> requests;
+    try {
+        requests = load_scenario(scenarioFile);
+    } catch (std::exception& e) {
+        std::cerr << "Invalid scenario " << scenarioFile << ": " << e.what() << std::endl;
+        exit(1);
+    }
+
+    auto context = nabto::client::Context::create();
+    std::vector<std::shared_ptr<nabto::client::Connection> > conns;
+    for (int i = 0; i < connections; i++) {
+        conns.push_back(create_connection(context, config));
+    }
+
+    // Connections are made before the clock starts so the handshakes
+    // are not part of the measurement.
+    auto end = std::chrono::steady_clock::now() + std::chrono::seconds(duration);
+    LoadRunner runner(requests, end);
+    for (auto connection : conns) {
+        runner.start(connection, inFlight);
+    }
+    runner.wait();
+
+    if (jsonReport) {
+        print_json_report(requests, runner, duration);
+    } else {
+        std::cout << "Ran " << duration << "s with " << connections << " connections and " << inFlight << " requests in flight per connection" << std::endl;
+        print_report(requests, runner, duration);
+    }
+
+    for (auto connection : conns) {
+        connection->close()->waitForResult();
+    }
+}
+
+std::vector<RequestTemplate> load_scenario(const std::string& scenarioFile)
+{
+    std::ifstream f(scenarioFile);
+    if (!f) {
+        throw std::runtime_error("cannot open file");
+    }
+    json scenario = json::parse(f);
+
+    std::vector<RequestTemplate> requests;
+    for (const auto& r : scenario.at("Requests")) {
+        RequestTemplate request;
+        request.method = r.at("Method").get<std::string>();
+        request.path = r.at("Path").get<std::string>();
+        request.name = r.value("Name", request.method + " " + request.path);
+        request.weight = r.value("Weight", 1);
+        if (request.weight < 1) {
+            throw std::invalid_argument("Weight must be positive for " + request.name);
+        }
+        std::vector<uint8_t> payload;
+        if (r.count("Cbor")) {
+            payload = json::to_cbor(r["Cbor"]);
+            request.contentFormat = CONTENT_FORMAT_APPLICATION_CBOR;
+        } else if (r.count("Json")) {
+            std::string s = r["Json"].dump();
+            payload.assign(s.begin(), s.end());
+            request.contentFormat = CONTENT_FORMAT_APPLICATION_JSON;
+        } else if (r.count("Text")) {
+            std::string s = r["Text"].get<std::string>();
+            payload.assign(s.begin(), s.end());
+            request.contentFormat = CONTENT_FORMAT_TEXT_PLAIN;
+        }
+        request.contentFormat = r.value("ContentFormat", request.contentFormat);
+        if (r.count("Cbor") || r.count("Json") || r.count("Text")) {
+            request.payload = std::make_shared<nabto::client::BufferImpl>(payload);
+        }
+        requests.push_back(request);
+    }
+    if (requests.empty()) {
+        throw std::invalid_argument("no requests");
+    }
+    return requests;
+}
+
+std::shared_ptr<nabto::client::Connection> create_connection(std::shared_ptr<nabto::client::Context> context, const json& config)
+{
+    auto connection = context->createConnection();
+    try {
+        connection->setProductId(config["ProductId"].get<std::string>());
+        connection->setDeviceId(config["DeviceId"].get<std::string>());
+        connection->setServerUrl(config["ServerUrl"].get<std::string>());
+        connection->setServerKey(config["ServerKey"].get<std::string>());
+        connection->setPrivateKey(config["PrivateKey"].get<std::string>());
+        connection->connect()->waitForResult();
+    } catch (std::exception& e) {
+        std::cerr << "Connect failed " << e.what() << std::endl;
+        exit(1);
+    }
+    if (config.count("DeviceFingerprint") && connection->getDeviceFingerprintHex() != config["DeviceFingerprint"].get<std::string>()) {
+        std::cerr << "device fingerprint does not match the paired fingerprint." << std::endl;
+        exit(1);
+    }
+    return connection;
+}
+
+static std::string ms(uint64_t us)
+{
+    std::ostringstream o;
+    o << std::fixed << std::setprecision(2) << us / 1000.0;
+    return o.str();
+}
+
+void print_report(const std::vector<RequestTemplate>& requests, LoadRunner& runner, int durationSeconds)
+{
+    nabto::common::LatencyHistogram total;
+    uint64_t errors = 0;
+    std::cout << std::left << std::setw(24) << "request" << std::right
+              << std::setw(10) << "count" << std::setw(10) << "errors"
+              << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p90"
+              << std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::setw(10) << "max"
+              << "  (ms)" << std::endl;
+    for (size_t i = 0; i < requests.size(); i++) {
+        const RequestStats& s = runner.stats()[i];
+        total.merge(s.histogram);
+        errors += s.failedResponses + s.transportErrors;
+        const auto& h = s.histogram;
+        std::cout << std::left << std::setw(24) << requests[i].name << std::right
+                  << std::setw(10) << h.count() << std::setw(10) << s.failedResponses + s.transportErrors
+                  << std::setw(10) << ms((uint64_t)h.mean()) << std::setw(10) << ms(h.valueAtPercentile(50))
+                  << std::setw(10) << ms(h.valueAtPercentile(90)) << std::setw(10) << ms(h.valueAtPercentile(99))
+                  << std::setw(10) << ms(h.valueAtPercentile(99.9)) << std::setw(10) << ms(h.max()) << std::endl;
+    }
+
+    std::cout << std::endl << "Latency distribution" << std::endl;
+    for (double p : { 50.0, 75.0, 90.0, 99.0, 99.9, 99.99, 100.0 }) {
+        std::cout << std::setw(10) << p << "%" << std::setw(12) << ms(total.valueAtPercentile(p)) << "ms" << std::endl;
+    }
+
+    std::cout << std::endl << "Status codes";
+    for (auto it : runner.statusCodes()) {
+        std::cout << " " << it.first << ": " << it.second;
+    }
+    std::cout << std::endl;
+    std::cout << total.count() << " responses, " << errors << " errors, "
+              << std::fixed << std::setprecision(1) << (double)total.count() / durationSeconds << " requests/s" << std::endl;
+}
+
+void print_json_report(const std::vector<RequestTemplate>& requests, LoadRunner& runner, int durationSeconds)
+{
+    auto summary = [](const nabto::common::LatencyHistogram& h) {
+        json s;
+        s["count"] = h.count();
+        s["min_us"] = h.min();
+        s["mean_us"] = h.mean();
+        s["p50_us"] = h.valueAtPercentile(50);
+        s["p90_us"] = h.valueAtPercentile(90);
+        s["p99_us"] = h.valueAtPercentile(99);
+        s["p999_us"] = h.valueAtPercentile(99.9);
+        s["max_us"] = h.max();
+        s["buckets"] = h.buckets();
+        return s;
+    };
+
+    json report;
+    nabto::common::LatencyHistogram total;
+    json perRequest = json::array();
+    for (size_t i = 0; i < requests.size(); i++) {
+        const RequestStats& s = runner.stats()[i];
+        total.merge(s.histogram);
+        json r = summary(s.histogram);
+        r["name"] = requests[i].name;
+        r["failed_responses"] = s.failedResponses;
+        r["transport_errors"] = s.transportErrors;
+        perRequest.push_back(r);
+    }
+    report["duration_s"] = durationSeconds;
+    report["requests_per_s"] = (double)total.count() / durationSeconds;
+    report["latency"] = summary(total);
+    report["requests"] = perRequest;
+    json statusCodes = json::object();
+    for (auto it : runner.statusCodes()) {
+        statusCodes[std::to_string(it.first)] = it.second;
+    }
+    report["status_codes"] = statusCodes;
+    std::cout << report.dump(2) << std::endl;
+}
@@ -0,0 +1,39 @@
+#include "coap_observer.hpp"
+
+#include <sstream>
+
+namespace nabto {
+namespace common {
+
+static const int CONTENT_FORMAT_APPLICATION_CBOR = 60;
+
+bool CoapObserver::next(json& state)
+{
+    for (;;) {
+        std::stringstream path;
+        path << path_ << "/" << version_;
+        coap_ = connection_->createCoap("GET", path.str());
+        coap_->execute()->waitForResult();
+        if (coap_->getResponseStatusCode() == 203) {
+            // Not modified, the device held the request as long as it
+            // will, ask again.
+            continue;
+        }
+        if (coap_->getResponseStatusCode() != 205 || coap_->getResponseContentFormat() != CONTENT_FORMAT_APPLICATION_CBOR) {
+            return false;
+        }
+        auto buffer = coap_->getResponsePayload();
+        std::vector<uint8_t> cbor(buffer->data(), buffer->data()+buffer->size());
+        json root = json::from_cbor(cbor);
+        uint64_t version = root["Version"].get<uint64_t>();
+        if (version == version_) {
+            // The device released the request without a change, ask again.
+            continue;
+        }
+        version_ = version;
+        state = root["State"];
+        return true;
+    }
+}
+
+} } // namespace
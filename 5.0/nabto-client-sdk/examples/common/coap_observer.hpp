@@ -0,0 +1,51 @@
+#pragma once
+
+#include <nabto_client.hpp>
+
+#include <nlohmann/json.hpp>
+
+#include <memory>
+#include <string>
+
+using json = nlohmann::json;
+
+namespace nabto {
+namespace common {
+
+/**
+ * Observe a resource which supports version based change
+ * notifications, e.g. GET /heat-pump/observe/{version}.
+ *
+ * Each request carries the last seen version. The device holds the
+ * request until the resource changes and responds with the CBOR map
+ * {"Version": n, "State": ...}. This replaces polling with one
+ * request per change. If nothing changes for a while the device
+ * answers with 2.03 not modified and the request is sent again.
+ */
+class CoapObserver {
+ public:
+    CoapObserver(std::shared_ptr<nabto::client::Connection> connection, const std::string& path)
+        : connection_(connection), path_(path)
+    {
+    }
+
+    /**
+     * Wait for the next representation of the resource.
+     *
+     * @return true and the new state, false if the device responded
+     * with an error, the failed request is available from lastCoap().
+     * Throws NabtoException if the request could not be executed.
+     */
+    bool next(json& state);
+
+    std::shared_ptr<nabto::client::Coap> lastCoap() { return coap_; }
+    uint64_t version() { return version_; }
+
+ private:
+    std::shared_ptr<nabto::client::Connection> connection_;
+    std::string path_;
+    std::shared_ptr<nabto::client::Coap> coap_;
+    uint64_t version_ = 0;
+};
+
+} } // namespace
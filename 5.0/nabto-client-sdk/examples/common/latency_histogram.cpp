@@ -0,0 +1,106 @@
+#include "latency_histogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace nabto {
+namespace common {
+
+static const unsigned SUB_BUCKET_BITS = 4;
+static const uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+// linear buckets below 16 and 16 buckets for each of the powers 2^4 .. 2^63
+static const size_t BUCKET_COUNT = SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+LatencyHistogram::LatencyHistogram()
+    : counts_(BUCKET_COUNT, 0)
+{
+}
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration latency)
+{
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    recordMicroseconds(us < 0 ? 0 : (uint64_t)us);
+}
+
+void LatencyHistogram::recordMicroseconds(uint64_t value)
+{
+    counts_[bucketIndex(value)]++;
+    count_++;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+    sum_ += (double)value;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other)
+{
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    sum_ += other.sum_;
+}
+
+double LatencyHistogram::mean() const
+{
+    if (count_ == 0) {
+        return 0;
+    }
+    return sum_ / count_;
+}
+
+uint64_t LatencyHistogram::valueAtPercentile(double percentile) const
+{
+    if (count_ == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)std::ceil(percentile / 100.0 * count_);
+    target = std::max<uint64_t>(1, std::min(target, count_));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        seen += counts_[i];
+        if (seen >= target) {
+            return std::min(bucketUpperBound(i), max_);
+        }
+    }
+    return max_;
+}
+
+nlohmann::json LatencyHistogram::buckets() const
+{
+    nlohmann::json buckets = nlohmann::json::array();
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        if (counts_[i] > 0) {
+            buckets.push_back({ bucketUpperBound(i), counts_[i] });
+        }
+    }
+    return buckets;
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t value)
+{
+    if (value < SUB_BUCKETS) {
+        return (size_t)value;
+    }
+    unsigned msb = 0;
+    for (uint64_t v = value; v > 1; v >>= 1) {
+        msb++;
+    }
+    unsigned shift = msb - SUB_BUCKET_BITS;
+    uint64_t sub = (value >> shift) & (SUB_BUCKETS - 1);
+    return (size_t)(SUB_BUCKETS + shift * SUB_BUCKETS + sub);
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t index)
+{
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    size_t shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+    uint64_t sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+    uint64_t lower = (SUB_BUCKETS + sub) << shift;
+    return lower + (((uint64_t)1 << shift) - 1);
+}
+
+} } // namespace
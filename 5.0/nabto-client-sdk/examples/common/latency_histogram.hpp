@@ -0,0 +1,63 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace nabto {
+namespace common {
+
+/**
+ * Histogram of latencies in microseconds with a bounded relative
+ * error, in the spirit of HdrHistogram.
+ *
+ * Values below 16us get a bucket each. Above that every power of two
+ * is split into 16 linear buckets, so a recorded value is reported
+ * with at most 1/16 relative error. The histogram has a fixed size
+ * and recording does not allocate.
+ *
+ * The histogram is not thread safe, record into one histogram per
+ * thread or guard it and merge the histograms when reporting.
+ */
+class LatencyHistogram {
+ public:
+    LatencyHistogram();
+
+    void record(std::chrono::steady_clock::duration latency);
+    void recordMicroseconds(uint64_t value);
+
+    /**
+     * Add the counts of another histogram to this one.
+     */
+    void merge(const LatencyHistogram& other);
+
+    uint64_t count() const { return count_; }
+    uint64_t min() const { return count_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+    double mean() const;
+
+    /**
+     * The value below which the given percentage of the recorded
+     * values lies, e.g. valueAtPercentile(99.9).
+     */
+    uint64_t valueAtPercentile(double percentile) const;
+
+    /**
+     * Non empty buckets as an array of [upper bound us, count].
+     */
+    nlohmann::json buckets() const;
+
+ private:
+    static size_t bucketIndex(uint64_t value);
+    static uint64_t bucketUpperBound(size_t index);
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t min_ = UINT64_MAX;
+    uint64_t max_ = 0;
+    double sum_ = 0;
+};
+
+} } // namespace
@@ -0,0 +1,113 @@
+#include "message_stream.hpp"
+
+#include <vector>
+
+namespace nabto {
+namespace common {
+
+static const size_t MESSAGE_HEADER_SIZE = 4;
+
+std::shared_ptr<MessageStream> MessageStream::create(std::shared_ptr<nabto::client::Stream> stream, size_t maxMessageSize)
+{
+    return std::make_shared<MessageStream>(stream, maxMessageSize);
+}
+
+void MessageStream::send(std::shared_ptr<nabto::client::Buffer> message, std::chrono::milliseconds deadline)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (failed_ || closed_) {
+            return;
+        }
+        PendingMessage pending;
+        pending.data = message;
+        pending.hasDeadline = deadline.count() > 0;
+        pending.deadline = std::chrono::steady_clock::now() + deadline;
+        sendQueue_.push_back(pending);
+        if (writing_) {
+            // the message is written when the current write completes.
+            return;
+        }
+        writing_ = true;
+    }
+    startWrite();
+}
+
+void MessageStream::startWrite()
+{
+    PendingMessage next;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        while (!sendQueue_.empty() && sendQueue_.front().hasDeadline && sendQueue_.front().deadline < now) {
+            sendQueue_.pop_front();
+            dropped_++;
+        }
+        if (sendQueue_.empty()) {
+            writing_ = false;
+            writeIdle_.notify_all();
+            return;
+        }
+        next = sendQueue_.front();
+        sendQueue_.pop_front();
+    }
+
+    size_t length = next.data->size();
+    std::vector<unsigned char> frame(MESSAGE_HEADER_SIZE + length);
+    frame[0] = (unsigned char)(length >> 24);
+    frame[1] = (unsigned char)(length >> 16);
+    frame[2] = (unsigned char)(length >> 8);
+    frame[3] = (unsigned char)(length);
+    std::copy(next.data->data(), next.data->data() + length, frame.begin() + MESSAGE_HEADER_SIZE);
+
+    auto self = shared_from_this();
+    stream_->write(std::make_shared<nabto::client::BufferImpl>(frame))->callback([self](nabto::client::Status status) {
+            self->writeDone(status);
+        });
+}
+
+void MessageStream::writeDone(nabto::client::Status status)
+{
+    if (!status.ok()) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        failed_ = true;
+        writing_ = false;
+        sendQueue_.clear();
+        writeIdle_.notify_all();
+        return;
+    }
+    startWrite();
+}
+
+std::shared_ptr<nabto::client::Buffer> MessageStream::receive()
+{
+    auto header = stream_->readAll(MESSAGE_HEADER_SIZE)->waitForResult();
+    const unsigned char* h = header->data();
+    size_t length = ((size_t)h[0] << 24) | ((size_t)h[1] << 16) | ((size_t)h[2] << 8) | (size_t)h[3];
+    if (length > maxMessageSize_) {
+        // The stream cannot be resynchronized, the caller should close it.
+        return nullptr;
+    }
+    if (length == 0) {
+        return std::make_shared<nabto::client::BufferImpl>(std::vector<unsigned char>());
+    }
+    return stream_->readAll(length)->waitForResult();
+}
+
+void MessageStream::close()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        closed_ = true;
+        writeIdle_.wait(lock, [this](){ return !writing_; });
+    }
+    stream_->close()->waitForResult();
+}
+
+size_t MessageStream::droppedCount()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return dropped_;
+}
+
+} } // namespace
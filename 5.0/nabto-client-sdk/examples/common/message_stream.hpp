@@ -0,0 +1,87 @@
+#pragma once
+
+#include <nabto_client.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+namespace nabto {
+namespace common {
+
+/**
+ * Message oriented channel on top of a nabto stream.
+ *
+ * Each message is framed with a 4 byte big endian length. Messages
+ * can be given a deadline, a message which is still waiting in the
+ * send queue when its deadline passes is dropped instead of being
+ * written. This lets real time data such as audio or video frames
+ * skip stale frames instead of queueing up behind a slow stream.
+ *
+ * The underlying stream is still reliable and ordered, so a message
+ * which has been handed to the stream is always delivered.
+ */
+class MessageStream : public std::enable_shared_from_this<MessageStream> {
+ public:
+    static std::shared_ptr<MessageStream> create(std::shared_ptr<nabto::client::Stream> stream, size_t maxMessageSize = 65536);
+
+    /**
+     * Queue a message for sending.
+     *
+     * @param message   The message to send.
+     * @param deadline  Drop the message if it has not been written
+     *                  within this time. Zero means no deadline.
+     */
+    void send(std::shared_ptr<nabto::client::Buffer> message, std::chrono::milliseconds deadline = std::chrono::milliseconds(0));
+
+    /**
+     * Wait for the next message.
+     *
+     * @return the message or nullptr if the message exceeds the
+     * maximum message size. Throws NabtoException if the stream fails
+     * or reaches end of file.
+     */
+    std::shared_ptr<nabto::client::Buffer> receive();
+
+    /**
+     * Wait until the queued messages have been written or dropped and
+     * close the write direction of the stream. Messages sent after
+     * close are discarded. Throws NabtoException if the stream could
+     * not be closed.
+     */
+    void close();
+
+    /**
+     * Number of messages dropped because their deadline passed.
+     */
+    size_t droppedCount();
+
+    MessageStream(std::shared_ptr<nabto::client::Stream> stream, size_t maxMessageSize)
+        : stream_(stream), maxMessageSize_(maxMessageSize)
+    {
+    }
+ private:
+    struct PendingMessage {
+        std::shared_ptr<nabto::client::Buffer> data;
+        std::chrono::steady_clock::time_point deadline;
+        bool hasDeadline;
+    };
+
+    void startWrite();
+    void writeDone(nabto::client::Status status);
+
+    std::shared_ptr<nabto::client::Stream> stream_;
+    size_t maxMessageSize_;
+
+    std::mutex mutex_;
+    std::condition_variable writeIdle_;
+    std::deque<PendingMessage> sendQueue_;
+    bool writing_ = false;
+    bool failed_ = false;
+    bool closed_ = false;
+    size_t dropped_ = 0;
+};
+
+} } // namespace
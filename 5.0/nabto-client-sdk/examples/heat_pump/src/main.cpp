@@ -1,4 +1,5 @@
 #include <nabto_client.hpp>
+#include <nabto/nabto_client.h>
 
 #include <cxxopts.hpp>
 
@@ -9,11 +10,27 @@
 #include <fstream>
 
 #include "json_config.hpp"
+#include "coap_observer.hpp"
 
 using json = nlohmann::json;
 
 const static int CONTENT_FORMAT_APPLICATION_CBOR = 60; // rfc 7059
 
+/**
+ * Print how long connect and coap requests takes.
+ */
+class TimingTracer : public nabto::client::Tracer {
+ public:
+    void span(const nabto::client::TraceSpan& span) {
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(span.end - span.start);
+        std::cout << "[timing] " << span.name << " " << span.detail << " " << duration.count() << "ms";
+        if (span.errorCode != 0) {
+            std::cout << " error " << span.errorCode;
+        }
+        std::cout << std::endl;
+    }
+};
+
 void heat_pump_pair(const std::string& configFile, const std::string& productId, const std::string& deviceId, const std::string& server, const std::string& serverKey)
 {
     json config;
@@ -165,6 +182,31 @@ void heat_pump_get(std::shared_ptr<nabto::client::Connection> connection)
     }
 }
 
+void heat_pump_observe(std::shared_ptr<nabto::client::Connection> connection)
+{
+    nabto::common::CoapObserver observer(connection, "/heat-pump/observe");
+    json state;
+    for (;;) {
+        try {
+            if (!observer.next(state)) {
+                break;
+            }
+        } catch (nabto::client::NabtoException& e) {
+            if (e.status().getErrorCode() == NABTO_CLIENT_EC_TIMEOUT) {
+                // The request is sent again with the last seen version.
+                continue;
+            }
+            std::cerr << "Observe failed: " << e.what() << std::endl;
+            connection->close()->waitForResult();
+            exit(1);
+        }
+        std::cout << state << std::endl;
+    }
+    handle_coap_error(observer.lastCoap());
+    connection->close()->waitForResult();
+    exit(1);
+}
+
 void heat_pump_set_data(std::shared_ptr<nabto::client::Coap> coap, json doc)
 {
     std::vector<uint8_t> cbor = json::to_cbor(doc);
@@ -343,7 +385,8 @@ int main(int argc, char** argv)
         ("h,help", "Show help")
         ("version", "Show version")
         ("c,config", "Configuration file", cxxopts::value<std::string>()->default_value("heat_pump_client.json"))
-        ("scan", "Scan for heat pumps");
+        ("scan", "Scan for heat pumps")
+        ("timing", "Print the duration of connect and each coap request");
 
     options.add_options("Pairing")
         ("pair", "Pair with a device")
@@ -363,6 +406,7 @@ int main(int argc, char** argv)
 
     options.add_options("Heatpump")
         ("get", "Get heatpump state")
+        ("observe", "Print the heatpump state each time it changes")
         ("set-target", "Set target temperature", cxxopts::value<double>())
         ("set-power", "Turn ON or OFF", cxxopts::value<std::string>())
         ("set-mode", "Set heatpump mode, valid modes: COOL, HEAT, FAN, DRY", cxxopts::value<std::string>());
@@ -404,10 +448,15 @@ int main(int argc, char** argv)
     }
 
     auto context = nabto::client::Context::create();
+    if (result.count("timing")) {
+        context->setTracer(std::make_shared<TimingTracer>());
+    }
     auto connection = createConnection(context, result["config"].as<std::string>());
 
     if (result.count("get")) {
         heat_pump_get(connection);
+    } else if (result.count("observe")) {
+        heat_pump_observe(connection);
     } else if (result.count("users-list")) {
         iam_users_list(connection);
     } else if (result.count("users-get")) {
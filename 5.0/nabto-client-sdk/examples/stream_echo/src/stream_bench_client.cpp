@@ -0,0 +1,326 @@
+#include "nabto_client.hpp"
+
+#include <cxxopts.hpp>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+
+// The port of the benchmark streams of the stream echo device, see
+// stream_bench.hpp in the device examples.
+static const uint32_t BENCH_STREAM_PORT = 43;
+static const size_t RTT_PROBE_SIZE = 64;
+
+enum class BenchMode {
+    UPLOAD,
+    DOWNLOAD,
+    BIDIR,
+    ECHO
+};
+
+struct BenchResult {
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> received{0};
+    std::mutex mutex;
+    std::vector<double> rttMs;
+
+    void addRtt(std::chrono::steady_clock::duration rtt) {
+        std::unique_lock<std::mutex> lock(mutex);
+        rttMs.push_back(std::chrono::duration<double, std::milli>(rtt).count());
+    }
+};
+
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+static bool parseMode(const std::string& mode, BenchMode& out);
+static void run_stream_bench(const cxxopts::ParseResult& options);
+static std::shared_ptr<nabto::client::Stream> openBenchStream(std::shared_ptr<nabto::client::Connection> connection, char mode, size_t chunkSize);
+static void writer(std::shared_ptr<nabto::client::Stream> stream, bool upload, size_t messageSize, TimePoint end, BenchResult* result);
+static void reader(std::shared_ptr<nabto::client::Stream> stream, size_t messageSize, TimePoint end, BenchResult* result);
+static void echoer(std::shared_ptr<nabto::client::Stream> stream, size_t messageSize, std::chrono::milliseconds interval, TimePoint end, BenchResult* result);
+static json rttSummary(std::vector<double> samples);
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("Stream bench client", "Nabto stream throughput and latency benchmark against the stream echo device.");
+
+    options.add_options("Connection")
+        ("h,help", "Show help")
+        ("log-level", "Log level (error|info|trace)", cxxopts::value<std::string>()->default_value(""))
+        ("p,product", "Product id", cxxopts::value<std::string>())
+        ("d,device", "Device id", cxxopts::value<std::string>())
+        ("s,server", "Server url of basestation", cxxopts::value<std::string>())
+        ("k,server-key", "Key to use with the server", cxxopts::value<std::string>())
+        ("server-jwt-token", "Optional jwt token to validate the client", cxxopts::value<std::string>()->default_value(""))
+        ;
+
+    options.add_options("Benchmark")
+        ("m,mode", "upload|download|bidir|echo", cxxopts::value<std::string>()->default_value("upload"))
+        ("P,streams", "Number of parallel streams", cxxopts::value<int>()->default_value("1"))
+        ("l,message-size", "Bytes per stream write or read, at most 65536", cxxopts::value<int>()->default_value("16384"))
+        ("t,duration", "Test duration in seconds", cxxopts::value<int>()->default_value("10"))
+        ("rtt-interval", "Milliseconds between round trip probes on an extra echo stream, 0 disables the probe", cxxopts::value<int>()->default_value("100"))
+        ;
+
+    try {
+        auto result = options.parse(argc, argv);
+        if (result.count("help"))
+        {
+            std::cout << options.help() << std::endl;
+            exit(0);
+        }
+        run_stream_bench(result);
+    } catch (const cxxopts::OptionException& e) {
+        std::cerr << "Error parsing options: " << e.what() << std::endl;
+        std::cerr << options.help() << std::endl;
+        exit(1);
+    } catch (const std::domain_error& e) {
+        std::cerr << "Error parsing options: " << e.what() << std::endl;
+        std::cerr << options.help() << std::endl;
+        exit(1);
+    }
+}
+
+class MyLogger : public nabto::client::Logger
+{
+ public:
+    void log(nabto::client::LogMessage message) {
+        std::cerr << message.getMessage() << std::endl;
+    }
+};
+
+bool parseMode(const std::string& mode, BenchMode& out)
+{
+    if (mode == "upload") {
+        out = BenchMode::UPLOAD;
+    } else if (mode == "download") {
+        out = BenchMode::DOWNLOAD;
+    } else if (mode == "bidir") {
+        out = BenchMode::BIDIR;
+    } else if (mode == "echo") {
+        out = BenchMode::ECHO;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void run_stream_bench(const cxxopts::ParseResult& options)
+{
+    std::string modeName = options["mode"].as<std::string>();
+    BenchMode mode;
+    if (!parseMode(modeName, mode)) {
+        throw std::domain_error("invalid mode " + modeName);
+    }
+    int streams = options["streams"].as<int>();
+    int messageSize = options["message-size"].as<int>();
+    int duration = options["duration"].as<int>();
+    int rttInterval = options["rtt-interval"].as<int>();
+    if (streams < 1 || messageSize < 1 || messageSize > 65536 || duration < 1 || rttInterval < 0) {
+        throw std::domain_error("streams, message-size or duration out of range");
+    }
+
+    auto ctx = nabto::client::Context::create();
+    std::string logLevel = options["log-level"].as<std::string>();
+    if (!logLevel.empty()) {
+        ctx->setLogger(std::make_shared<MyLogger>());
+        ctx->setLogLevel(logLevel);
+    }
+
+    auto connection = ctx->createConnection();
+    connection->setProductId(options["product"].as<std::string>());
+    connection->setDeviceId(options["device"].as<std::string>());
+    connection->setServerUrl(options["server"].as<std::string>());
+    connection->setServerKey(options["server-key"].as<std::string>());
+    connection->setPrivateKey(ctx->createPrivateKey());
+    connection->setServerJwtToken(options["server-jwt-token"].as<std::string>());
+
+    try {
+        connection->connect()->waitForResult();
+    } catch (std::exception& e) {
+        std::cerr << "Connect failed " << e.what() << std::endl;
+        exit(1);
+    }
+
+    const char modeByte[] = { 'u', 'd', 'b', 'e' };
+    std::vector<std::shared_ptr<nabto::client::Stream> > benchStreams;
+    std::shared_ptr<nabto::client::Stream> probeStream;
+    try {
+        for (int i = 0; i < streams; i++) {
+            benchStreams.push_back(openBenchStream(connection, modeByte[(int)mode], messageSize));
+        }
+        if (rttInterval > 0) {
+            probeStream = openBenchStream(connection, 'e', RTT_PROBE_SIZE);
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Could not open benchmark streams " << e.what() << std::endl;
+        exit(1);
+    }
+
+    // All streams are open before the clock starts such that the
+    // stream handshakes are not part of the measurement.
+    std::vector<std::unique_ptr<BenchResult> > results;
+    BenchResult probeResult;
+    std::vector<std::thread> threads;
+    TimePoint end = std::chrono::steady_clock::now() + std::chrono::seconds(duration);
+    for (auto stream : benchStreams) {
+        results.emplace_back(new BenchResult());
+        BenchResult* result = results.back().get();
+        if (mode == BenchMode::ECHO) {
+            threads.push_back(std::thread(echoer, stream, messageSize, std::chrono::milliseconds(0), end, result));
+        } else {
+            bool upload = mode == BenchMode::UPLOAD || mode == BenchMode::BIDIR;
+            threads.push_back(std::thread(writer, stream, upload, messageSize, end, result));
+            threads.push_back(std::thread(reader, stream, messageSize, end, result));
+        }
+    }
+    if (probeStream) {
+        threads.push_back(std::thread(echoer, probeStream, RTT_PROBE_SIZE, std::chrono::milliseconds(rttInterval), end, &probeResult));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    json report;
+    report["mode"] = modeName;
+    report["streams"] = streams;
+    report["message_size"] = messageSize;
+    report["duration_s"] = duration;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    // The round trips of the bench streams in echo mode carry
+    // message-size bytes, they are reported apart from the probe.
+    std::vector<double> echoRtt;
+    json perStream = json::array();
+    for (auto& result : results) {
+        sent += result->sent;
+        received += result->received;
+        echoRtt.insert(echoRtt.end(), result->rttMs.begin(), result->rttMs.end());
+        perStream.push_back({ {"sent_bytes", result->sent.load()}, {"received_bytes", result->received.load()} });
+    }
+    report["sent_bytes"] = sent;
+    report["received_bytes"] = received;
+    report["sent_mbit_per_s"] = (double)sent * 8 / duration / 1e6;
+    report["received_mbit_per_s"] = (double)received * 8 / duration / 1e6;
+    report["per_stream"] = perStream;
+    report["rtt_ms"] = rttSummary(probeResult.rttMs);
+    report["echo_rtt_ms"] = rttSummary(echoRtt);
+    // The client SDK does not expose stream retransmission counters.
+    report["retransmissions"] = nullptr;
+    try {
+        report["connection"] = json::parse(connection->getInfo());
+    } catch (std::exception& e) {
+        report["connection"] = nullptr;
+    }
+    std::cout << report.dump(2) << std::endl;
+
+    connection->close()->waitForResult();
+}
+
+std::shared_ptr<nabto::client::Stream> openBenchStream(std::shared_ptr<nabto::client::Connection> connection, char mode, size_t chunkSize)
+{
+    auto stream = connection->createStream();
+    stream->open(BENCH_STREAM_PORT)->waitForResult();
+    std::vector<unsigned char> header = {
+        (unsigned char)mode,
+        (unsigned char)(chunkSize >> 24),
+        (unsigned char)(chunkSize >> 16),
+        (unsigned char)(chunkSize >> 8),
+        (unsigned char)(chunkSize)
+    };
+    stream->write(std::make_shared<nabto::client::BufferImpl>(header))->waitForResult();
+    return stream;
+}
+
+void writer(std::shared_ptr<nabto::client::Stream> stream, bool upload, size_t messageSize, TimePoint end, BenchResult* result)
+{
+    try {
+        if (upload) {
+            auto buffer = std::make_shared<nabto::client::BufferImpl>(std::vector<unsigned char>(messageSize, 0x55));
+            while (std::chrono::steady_clock::now() < end) {
+                stream->write(buffer)->waitForResult();
+                // a write which completes after the end is not part
+                // of the measured duration.
+                if (std::chrono::steady_clock::now() < end) {
+                    result->sent += messageSize;
+                }
+            }
+        } else {
+            std::this_thread::sleep_until(end);
+        }
+        // The device stops sending and closes its side when it reads
+        // EOF, which ends the reader.
+        stream->close()->waitForResult();
+    } catch (std::exception& e) {
+        std::cerr << "Stream write failed " << e.what() << std::endl;
+    }
+}
+
+void reader(std::shared_ptr<nabto::client::Stream> stream, size_t messageSize, TimePoint end, BenchResult* result)
+{
+    for (;;) {
+        try {
+            auto buffer = stream->readSome(messageSize)->waitForResult();
+            if (std::chrono::steady_clock::now() < end) {
+                result->received += buffer->size();
+            }
+        } catch (...) {
+            // EOF or a failed stream.
+            return;
+        }
+    }
+}
+
+void echoer(std::shared_ptr<nabto::client::Stream> stream, size_t messageSize, std::chrono::milliseconds interval, TimePoint end, BenchResult* result)
+{
+    auto buffer = std::make_shared<nabto::client::BufferImpl>(std::vector<unsigned char>(messageSize, 0xaa));
+    try {
+        while (std::chrono::steady_clock::now() < end) {
+            auto begin = std::chrono::steady_clock::now();
+            stream->write(buffer)->waitForResult();
+            stream->readAll(messageSize)->waitForResult();
+            auto now = std::chrono::steady_clock::now();
+            result->addRtt(now - begin);
+            if (now < end) {
+                result->sent += messageSize;
+                result->received += messageSize;
+            }
+            if (interval.count() > 0) {
+                std::this_thread::sleep_until(std::min(end, begin + interval));
+            }
+        }
+        stream->close()->waitForResult();
+        // wait for the device to close its side.
+        for (;;) {
+            stream->readSome(messageSize)->waitForResult();
+        }
+    } catch (...) {
+    }
+}
+
+json rttSummary(std::vector<double> samples)
+{
+    if (samples.empty()) {
+        return nullptr;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&samples](double p) {
+        size_t index = (size_t)(p * (samples.size() - 1) + 0.5);
+        return samples[index];
+    };
+    json summary;
+    summary["samples"] = samples.size();
+    summary["min"] = samples.front();
+    summary["p50"] = percentile(0.50);
+    summary["p90"] = percentile(0.90);
+    summary["p99"] = percentile(0.99);
+    summary["max"] = samples.back();
+    return summary;
+}
@@ -1,4 +1,5 @@
 #include "nabto_client.hpp"
+#include "message_stream.hpp"
 
 #include <cxxopts.hpp>
 
@@ -10,7 +11,9 @@
 #include <thread>
 
 static void reader(std::shared_ptr<nabto::client::Stream> stream);
-static void run_stream_echo_client(const std::string& logLevel, const std::string& productId, const std::string& deviceId, const std::string& server, const std::string& serverKey, const std::string& serverJwtToken);
+static void messageReader(std::shared_ptr<nabto::common::MessageStream> messageStream);
+static void closeStream(std::shared_ptr<nabto::client::Stream> stream, std::shared_ptr<nabto::common::MessageStream> messageStream);
+static void run_stream_echo_client(const std::string& logLevel, const std::string& productId, const std::string& deviceId, const std::string& server, const std::string& serverKey, const std::string& serverJwtToken, int messageDeadline);
 
 
 int main(int argc, char** argv)
@@ -26,6 +29,7 @@ int main(int argc, char** argv)
         ("s,server", "Server url of basestation", cxxopts::value<std::string>())
         ("k,server-key", "Key to use with the server", cxxopts::value<std::string>())
         ("server-jwt-token", "Optional jwt token to validate the client", cxxopts::value<std::string>()->default_value(""))
+        ("message-deadline", "Send each input as a framed message which is dropped if not sent within this many milliseconds, 0 sends raw data", cxxopts::value<int>()->default_value("0"))
         ;
 
 
@@ -42,7 +46,8 @@ int main(int argc, char** argv)
                                result["device"].as<std::string>(),
                                result["server"].as<std::string>(),
                                result["server-key"].as<std::string>(),
-                               result["server-jwt-token"].as<std::string>());
+                               result["server-jwt-token"].as<std::string>(),
+                               result["message-deadline"].as<int>());
     } catch(...) {
         std::cout << options.help() << std::endl;
         exit(1);
@@ -57,7 +62,7 @@ class MyLogger : public nabto::client::Logger
     }
 };
 
-void run_stream_echo_client(const std::string& logLevel, const std::string& productId, const std::string& deviceId, const std::string& server, const std::string& serverKey, const std::string& serverJwtToken)
+void run_stream_echo_client(const std::string& logLevel, const std::string& productId, const std::string& deviceId, const std::string& server, const std::string& serverKey, const std::string& serverJwtToken, int messageDeadline)
 {
     auto ctx = nabto::client::Context::create();
     if (!logLevel.empty()) {
@@ -81,32 +86,49 @@ void run_stream_echo_client(const std::string& logLevel, const std::string& prod
         exit(1);
     }
 
+    // Framed messages are echoed message by message on port 44, raw
+    // data byte by byte on port 42.
     auto stream = connection->createStream();
-    stream->open(42)->waitForResult();
-
-    std::thread t(reader, stream);
+    stream->open(messageDeadline > 0 ? 44 : 42)->waitForResult();
+
+    std::shared_ptr<nabto::common::MessageStream> messageStream;
+    std::thread t;
+    if (messageDeadline > 0) {
+        messageStream = nabto::common::MessageStream::create(stream);
+        t = std::thread(messageReader, messageStream);
+    } else {
+        t = std::thread(reader, stream);
+    }
 
     for (;;) {
         std::string input;
         try {
             std::cin >> input;
             if(std::cin.eof()){
-                stream->close()->waitForResult();
+                closeStream(stream, messageStream);
                 connection->close();
                 break;
             }
         } catch (...) {
             // TODO clean exit
-            stream->close()->waitForResult();
+            closeStream(stream, messageStream);
             connection->close();
             break;
         }
         auto buffer = std::make_shared<nabto::client::BufferImpl>(reinterpret_cast<const unsigned char*>(input.data()), input.size());
-        stream->write(buffer)->waitForResult();
+        if (messageStream) {
+            messageStream->send(buffer, std::chrono::milliseconds(messageDeadline));
+        } else {
+            stream->write(buffer)->waitForResult();
+        }
     }
 
     t.join();
 
+    if (messageStream) {
+        std::cout << "Dropped " << messageStream->droppedCount() << " messages which missed their deadline" << std::endl;
+    }
+
 }
 
 
@@ -121,3 +143,30 @@ void reader(std::shared_ptr<nabto::client::Stream> stream)
         }
     }
 }
+
+void messageReader(std::shared_ptr<nabto::common::MessageStream> messageStream)
+{
+    for (;;) {
+        try {
+            std::shared_ptr<nabto::client::Buffer> buffer = messageStream->receive();
+            if (!buffer) {
+                std::cout << "Received a message larger than the maximum message size" << std::endl;
+                return;
+            }
+            std::cout << std::string(reinterpret_cast<const char*>(buffer->data()), buffer->size()) << std::endl;
+        } catch (...) {
+            return;
+        }
+    }
+}
+
+void closeStream(std::shared_ptr<nabto::client::Stream> stream, std::shared_ptr<nabto::common::MessageStream> messageStream)
+{
+    // Let queued messages be written or dropped before the stream is
+    // closed.
+    if (messageStream) {
+        messageStream->close();
+    } else {
+        stream->close()->waitForResult();
+    }
+}
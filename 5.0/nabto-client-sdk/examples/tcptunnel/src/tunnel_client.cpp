@@ -11,6 +11,10 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
 
 using json = nlohmann::json;
 
@@ -18,8 +22,6 @@ enum {
   COAP_CONTENT_FORMAT_APPLICATION_CBOR = 60
 };
 
-// TODO reconnect when connection is closed.
-
 class MyLogger : public nabto::client::Logger
 {
  public:
@@ -28,127 +30,299 @@ class MyLogger : public nabto::client::Logger
     }
 };
 
+// The current connection and its events listener, replaced on each
+// reconnect. Guarded by activeMutex_ as the signal thread closes them.
+std::mutex activeMutex_;
 std::shared_ptr<nabto::client::Connection> connection_;
 std::shared_ptr<nabto::client::ConnectionEventsListener> connectionEventsListener_;
-
-void my_handler(int s){
+std::atomic<bool> stopping_(false);
+
+/**
+ * Wait for ctrl c. SIGINT is blocked in all other threads, so it is
+ * handled here instead of in an async signal handler which cannot
+ * safely touch the connection.
+ */
+void signalThread(sigset_t signals)
+{
+    int s;
+    if (sigwait(&signals, &s) != 0) {
+        return;
+    }
     printf("Caught signal %d\n",s);
-    connectionEventsListener_->stop();
-    connection_->close();
+    stopping_ = true;
+    std::unique_lock<std::mutex> lock(activeMutex_);
+    if (connectionEventsListener_) {
+        connectionEventsListener_->stop();
+    }
+    if (connection_) {
+        connection_->close();
+    }
 }
 
-static bool isPaired(std::shared_ptr<nabto::client::Connection> connection);
+enum class ConnectResult {
+    OK,
+    // The connection could not be made, it can be retried.
+    FAILED,
+    // The device is not the paired device, retrying does not help.
+    REJECTED
+};
 
-std::shared_ptr<nabto::client::Connection> createConnection(std::shared_ptr<nabto::client::Context> ctx, const std::string& logLevel, const std::string& configFile)
+static ConnectResult checkPaired(std::shared_ptr<nabto::client::Connection> connection);
+
+/**
+ * Adaptive keep alive.
+ *
+ * Keep alive packets keep the NAT bindings on the path to the device
+ * open. The keep alive interval which is used is stored in the config
+ * file as KeepAliveInterval. With --adaptive-keep-alive the interval is
+ * learned across connections: if a connection lived for several
+ * intervals and was closed by the user the NAT binding outlives the
+ * interval and the interval is stretched. A lost connection, e.g.
+ * because a NAT binding expired while the connection was idle, always
+ * halves the interval no matter how long it lived.
+ */
+const uint32_t minKeepAliveInterval = 5000;
+const uint32_t maxKeepAliveInterval = 300000;
+const uint32_t defaultKeepAliveInterval = 30000;
+// a connection which lived for this many intervals proves the interval.
+const uint32_t keepAliveProofIntervals = 4;
+
+/**
+ * The keep alive interval stored in the config, or
+ * defaultKeepAliveInterval if the value is missing or not a valid
+ * interval.
+ */
+uint32_t keepAliveInterval(const json& config)
+{
+    auto it = config.find("KeepAliveInterval");
+    if (it == config.end() || !it->is_number_unsigned()) {
+        return defaultKeepAliveInterval;
+    }
+    uint64_t interval = it->get<uint64_t>();
+    if (interval < minKeepAliveInterval || interval > maxKeepAliveInterval) {
+        return defaultKeepAliveInterval;
+    }
+    return (uint32_t)interval;
+}
+
+void adaptKeepAlive(const std::string& configFile, std::chrono::milliseconds lifetime, bool lost)
 {
     json config;
     if(!json_config_load(configFile, config)) {
-        std::cerr << "Could not read config file" << std::endl;
-        exit(1);
+        return;
     }
-
-    if (!logLevel.empty()) {
-        ctx->setLogger(std::make_shared<MyLogger>());
-        ctx->setLogLevel(logLevel);
+    uint32_t interval = keepAliveInterval(config);
+    uint32_t next = interval;
+    if (lost) {
+        next = std::max(interval / 2, minKeepAliveInterval);
+    } else if (lifetime.count() >= (int64_t)interval * keepAliveProofIntervals) {
+        next = std::min(interval + interval / 4, maxKeepAliveInterval);
+    }
+    if (next == interval) {
+        return;
+    }
+    std::cout << "Adjusting keep alive interval from " << interval << "ms to " << next << "ms" << std::endl;
+    config["KeepAliveInterval"] = next;
+    if (!json_config_save(configFile, config)) {
+        std::cerr << "Failed to write config to " << configFile << std::endl;
     }
+}
 
-    auto connection = ctx->createConnection();
+ConnectResult tryConnect(std::shared_ptr<nabto::client::Context> ctx, const json& config, std::shared_ptr<nabto::client::Connection>& connection)
+{
+    connection = ctx->createConnection();
     connection->setProductId(config["ProductId"].get<std::string>());
     connection->setDeviceId(config["DeviceId"].get<std::string>());
     connection->setServerUrl(config["ServerUrl"].get<std::string>());
     connection->setServerKey(config["ServerKey"].get<std::string>());
     connection->setPrivateKey(config["PrivateKey"].get<std::string>());
+    if (config.find("KeepAliveInterval") != config.end()) {
+        json options;
+        options["KeepAliveInterval"] = keepAliveInterval(config);
+        connection->setOptions(options.dump());
+    }
     try {
         connection->connect()->waitForResult();
     } catch (std::exception& e) {
         std::cerr << "Connect failed" << e.what() << std::endl;
-        exit(1);
+        return ConnectResult::FAILED;
     }
 
     try {
         if (connection->getDeviceFingerprintHex() != config["DeviceFingerprint"].get<std::string>()) {
             std::cerr << "device fingerprint does not match the paired fingerprint." << std::endl;
-            exit(1);
+            return ConnectResult::REJECTED;
         }
     } catch (...) {
         std::cerr << "Missing device fingerprint in config, pair with the device again" << std::endl;
-        exit(1);
+        return ConnectResult::REJECTED;
+    }
+
+    ConnectResult paired = checkPaired(connection);
+    if (paired != ConnectResult::OK) {
+        return paired;
     }
 
-    if (!isPaired(connection)) {
-        std::cerr << "Client is not paired with device, do the pairing again" << std::endl;
+    try {
+        json options = json::parse(connection->getOptions());
+        std::cout << "Connected, keep alive interval " << options["KeepAliveInterval"] << "ms" << std::endl;
+    } catch (std::exception& e) {
+        // the options are informational only.
+    }
+
+    return ConnectResult::OK;
+}
+
+std::shared_ptr<nabto::client::Connection> createConnection(std::shared_ptr<nabto::client::Context> ctx, const std::string& logLevel, const std::string& configFile)
+{
+    json config;
+    if(!json_config_load(configFile, config)) {
+        std::cerr << "Could not read config file" << std::endl;
         exit(1);
     }
 
+    if (!logLevel.empty()) {
+        ctx->setLogger(std::make_shared<MyLogger>());
+        ctx->setLogLevel(logLevel);
+    }
+
+    std::shared_ptr<nabto::client::Connection> connection;
+    if (tryConnect(ctx, config, connection) != ConnectResult::OK) {
+        exit(1);
+    }
     return connection;
 }
 
-bool isPaired(std::shared_ptr<nabto::client::Connection> connection)
+/**
+ * Reconnect after the connection has been lost, e.g. because the
+ * client changed network. Retries with exponential backoff until the
+ * connection is made or the application is stopped.
+ */
+std::shared_ptr<nabto::client::Connection> reconnect(std::shared_ptr<nabto::client::Context> ctx, const std::string& configFile)
+{
+    json config;
+    if(!json_config_load(configFile, config)) {
+        std::cerr << "Could not read config file" << std::endl;
+        return nullptr;
+    }
+
+    std::chrono::milliseconds backoff(500);
+    const std::chrono::milliseconds maxBackoff(30000);
+    while (!stopping_) {
+        std::shared_ptr<nabto::client::Connection> connection;
+        ConnectResult result = tryConnect(ctx, config, connection);
+        if (result == ConnectResult::OK) {
+            return connection;
+        } else if (result == ConnectResult::REJECTED) {
+            return nullptr;
+        }
+        std::cout << "Reconnect failed, retrying in " << backoff.count() << "ms" << std::endl;
+        auto retryAt = std::chrono::steady_clock::now() + backoff;
+        while (!stopping_ && std::chrono::steady_clock::now() < retryAt) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        backoff = std::min(backoff * 2, maxBackoff);
+    }
+    return nullptr;
+}
+
+ConnectResult checkPaired(std::shared_ptr<nabto::client::Connection> connection)
 {
     auto coap = connection->createCoap("GET", "/pairing/is-paired");
 
     try {
         coap->execute()->waitForResult();
-
-        return (coap->getResponseStatusCode() == 205);
-
+        if (coap->getResponseStatusCode() != 205) {
+            std::cerr << "Client is not paired with device, do the pairing again" << std::endl;
+            return ConnectResult::REJECTED;
+        }
+        return ConnectResult::OK;
     } catch(...) {
+        // e.g. the connection was lost again, which can be retried.
         std::cerr << "Cannot get pairing state" << std::endl;
-        exit(1);
+        return ConnectResult::FAILED;
     }
 }
 
-void tcptunnel(const std::string& logLevel, const std::string& configFile, uint16_t localPort, const std::string& remoteHost, uint16_t remotePort)
+void tcptunnel(const std::string& logLevel, const std::string& configFile, uint16_t localPort, const std::string& remoteHost, uint16_t remotePort, bool adaptiveKeepAlive)
 {
     std::cout << "Creating tunnel " << configFile << " local port " << localPort << " remote host " << remoteHost << " remote port " << remotePort << std::endl;
 
+    // Block SIGINT before any threads are started such that they all
+    // inherit the mask and only the signal thread receives it.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    std::thread(signalThread, signals).detach();
+
     auto ctx = nabto::client::Context::create();
 
     auto connection = createConnection(ctx, logLevel, configFile);
 
-    std::shared_ptr<nabto::client::TcpTunnel> tunnel;
-    try {
-        tunnel = connection->createTcpTunnel();
-        tunnel->open(localPort, remoteHost, remotePort)->waitForResult();
-    } catch (std::exception& e) {
-        std::cout << "open tunnel error: " << e.what() << std::endl;
-        connection->close();
-        return;
-    }
-    std::cout << "tunnel is opened" << std::endl;
-
-    // wait for ctrl c
-    struct sigaction sigIntHandler;
-
-    sigIntHandler.sa_handler = my_handler;
-    sigemptyset(&sigIntHandler.sa_mask);
-    sigIntHandler.sa_flags = 0;
-
-    sigaction(SIGINT, &sigIntHandler, NULL);
-
-    auto listener = connection->createEventsListener();
-
-    connection_ = connection;
-    connectionEventsListener_ = listener;
+    // The tunnel is bound to the connection. When the connection is
+    // lost, e.g. because the client moved to another network, a new
+    // connection is made and the tunnel is opened again on the same
+    // local port. Local TCP connections open at that time are lost.
+    while (connection) {
+        auto connectedAt = std::chrono::steady_clock::now();
+        std::shared_ptr<nabto::client::TcpTunnel> tunnel;
+        try {
+            tunnel = connection->createTcpTunnel();
+            tunnel->open(localPort, remoteHost, remotePort)->waitForResult();
+        } catch (std::exception& e) {
+            std::cout << "open tunnel error: " << e.what() << std::endl;
+            connection->close();
+            return;
+        }
+        std::cout << "tunnel is opened" << std::endl;
+
+        auto listener = connection->createEventsListener();
+
+        {
+            std::unique_lock<std::mutex> lock(activeMutex_);
+            connection_ = connection;
+            connectionEventsListener_ = listener;
+            if (stopping_) {
+                // ctrl c arrived while the connection was being made.
+                listener->stop();
+                connection->close();
+            }
+        }
 
-    std::thread t([listener](){
-            try {
-                while (true) {
-                    nabto::client::ConnectionEvent ce = listener->listen()->waitForResult();
-                    if (ce.getEvent() == NABTO_CLIENT_CONNECTION_EVENT_CLOSED) {
-                        std::cout << "Connection closed, closing application" << std::endl;
-                        return;
-                    }
+        try {
+            while (true) {
+                nabto::client::ConnectionEvent ce = listener->listen()->waitForResult();
+                if (ce.getEvent() == NABTO_CLIENT_CONNECTION_EVENT_CLOSED) {
+                    break;
+                } else if (ce.getEvent() == NABTO_CLIENT_CONNECTION_EVENT_CHANNEL_CHANGED) {
+                    std::cout << "Connection changed channel" << std::endl;
                 }
-            } catch (...) {
-                return;
             }
-        });
+        } catch (...) {
+            // the listener was stopped
+        }
 
-    t.join();
+        {
+            std::unique_lock<std::mutex> lock(activeMutex_);
+            connectionEventsListener_.reset();
+            connection_.reset();
+        }
+        tunnel.reset();
+        listener.reset();
+
+        if (adaptiveKeepAlive) {
+            auto lifetime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - connectedAt);
+            adaptKeepAlive(configFile, lifetime, !stopping_);
+        }
 
-    connection_.reset();
-    connectionEventsListener_.reset();
+        if (stopping_) {
+            std::cout << "Connection closed, closing application" << std::endl;
+            return;
+        }
+        std::cout << "Connection closed, reconnecting" << std::endl;
+        connection = reconnect(ctx, configFile);
+    }
 }
 
 void tcptunnel_pairing(const std::string& logLevel, const std::string& configFile, const std::string& productId, const std::string& deviceId, const std::string& server, const std::string& serverKey, const std::string& password)
@@ -252,7 +426,8 @@ int main(int argc, char** argv)
     options.add_options("TCPTunnelling")
         ("local-port", "Local port to bind tcp listener to", cxxopts::value<uint16_t>()->default_value("0"))
         ("remote-host", "Remote ip to connect to", cxxopts::value<std::string>()->default_value(""))
-        ("remote-port", "Remote port to connect to", cxxopts::value<uint16_t>()->default_value("0"));
+        ("remote-port", "Remote port to connect to", cxxopts::value<uint16_t>()->default_value("0"))
+        ("adaptive-keep-alive", "Learn the keep alive interval of the path to the device across connections, the interval is stored in the config file");
 
     auto result = options.parse(argc, argv);
     if (result.count("help"))
@@ -287,7 +462,8 @@ int main(int argc, char** argv)
                       result["config"].as<std::string>(),
                       result["local-port"].as<uint16_t>(),
                       result["remote-host"].as<std::string>(),
-                      result["remote-port"].as<uint16_t>());
+                      result["remote-port"].as<uint16_t>(),
+                      result.count("adaptive-keep-alive") > 0);
         } catch (const std::exception& e) {
             std::cout << e.what() << std::endl;
             exit(1);
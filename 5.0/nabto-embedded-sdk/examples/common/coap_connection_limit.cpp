@@ -0,0 +1,65 @@
+#include "coap_connection_limit.hpp"
+
+namespace nabto {
+namespace common {
+
+void CoapConnectionLimit::setLimits(size_t maxConnections, size_t reservedForKnown)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    maxConnections_ = maxConnections;
+    reservedForKnown_ = reservedForKnown;
+}
+
+bool CoapConnectionLimit::admit(NabtoDeviceConnectionRef connectionRef, const IsKnownClient& isKnownClient)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (admitted_.find(connectionRef) != admitted_.end()) {
+            return true;
+        }
+        if (maxConnections_ == 0) {
+            admitted_.insert(connectionRef);
+            stats_.admitted++;
+            return true;
+        }
+    }
+
+    // The fingerprint lookup is done without holding the lock.
+    bool knownClient = isKnownClient();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (admitted_.find(connectionRef) != admitted_.end()) {
+        return true;
+    }
+    size_t limit = maxConnections_;
+    if (limit > 0 && !knownClient) {
+        limit = (reservedForKnown_ < limit) ? limit - reservedForKnown_ : 0;
+    }
+    if (maxConnections_ > 0 && admitted_.size() >= limit) {
+        if (knownClient) {
+            stats_.rejectedKnown++;
+        } else {
+            stats_.rejectedUnknown++;
+        }
+        return false;
+    }
+    admitted_.insert(connectionRef);
+    stats_.admitted++;
+    return true;
+}
+
+void CoapConnectionLimit::connectionClosed(NabtoDeviceConnectionRef connectionRef)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    admitted_.erase(connectionRef);
+}
+
+CoapConnectionLimitStats CoapConnectionLimit::getStats()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    CoapConnectionLimitStats stats = stats_;
+    stats.connections = admitted_.size();
+    return stats;
+}
+
+} } // namespace
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+
+#include <functional>
+#include <mutex>
+#include <set>
+
+namespace nabto {
+namespace common {
+
+class CoapConnectionLimitStats {
+ public:
+    size_t connections = 0;
+    uint64_t admitted = 0;
+    // rejections are counted per call to admit
+    uint64_t rejectedKnown = 0;
+    uint64_t rejectedUnknown = 0;
+};
+
+/**
+ * Answer the CoAP requests of the application with 503 beyond N
+ * concurrent connections.
+ *
+ * This does not limit connections. The core still accepts and
+ * allocates every connection, and streams, tunnels and the CoAP
+ * endpoints of the core are not affected. It only lets the
+ * application turn away the requests of connections beyond the limit
+ * without doing any work for them.
+ *
+ * The last reservedForKnown slots are only given to clients whose
+ * fingerprints are known to IAM, such that paired users still get
+ * answers while the device is flooded by unknown clients.
+ */
+class CoapConnectionLimit {
+ public:
+    typedef std::function<bool ()> IsKnownClient;
+
+    /**
+     * @param maxConnections    0 means no limit.
+     * @param reservedForKnown  slots only available for known clients.
+     */
+    CoapConnectionLimit(size_t maxConnections = 0, size_t reservedForKnown = 0)
+        : maxConnections_(maxConnections), reservedForKnown_(reservedForKnown)
+    {
+    }
+
+    void setLimits(size_t maxConnections, size_t reservedForKnown);
+
+    /**
+     * Return whether the connection is within the limit. A connection
+     * which is admitted keeps its slot until it is closed. A
+     * connection which is turned away is evaluated again on each call,
+     * such that it is admitted once a slot is free. isKnownClient is
+     * only invoked for connections which do not have a slot.
+     */
+    bool admit(NabtoDeviceConnectionRef connectionRef, const IsKnownClient& isKnownClient);
+
+    void connectionClosed(NabtoDeviceConnectionRef connectionRef);
+
+    CoapConnectionLimitStats getStats();
+
+ private:
+    std::mutex mutex_;
+    size_t maxConnections_;
+    size_t reservedForKnown_;
+    std::set<NabtoDeviceConnectionRef> admitted_;
+    CoapConnectionLimitStats stats_;
+};
+
+} } // namespace
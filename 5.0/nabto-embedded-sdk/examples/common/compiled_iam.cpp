@@ -0,0 +1,313 @@
+#include "compiled_iam.hpp"
+
+#include <nabto/nabto_device_experimental.h>
+
+#include <iostream>
+
+#include <string.h>
+
+using json = nlohmann::json;
+
+namespace nabto {
+namespace common {
+
+CompiledIam::CompiledIam()
+{
+    connectionUserId_ = internLocked(attributes_, "Connection:UserId");
+}
+
+bool CompiledIam::load(const json& iam)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::shared_ptr<const State> state;
+    try {
+        state = compile(iam);
+    } catch (std::exception& e) {
+        // Keeping the previous state would keep the grants of users
+        // which were just removed or restricted.
+        std::cerr << "Failed to compile the IAM state, denying all actions: " << e.what() << std::endl;
+        state_ = std::make_shared<State>();
+        return false;
+    }
+    state_ = state;
+    return true;
+}
+
+CompiledIam::ActionId CompiledIam::actionId(const std::string& action)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return internLocked(actions_, action);
+}
+
+CompiledIam::AttributeId CompiledIam::attributeId(const std::string& attribute)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return internLocked(attributes_, attribute);
+}
+
+size_t CompiledIam::internLocked(std::unordered_map<std::string, size_t>& table, const std::string& name)
+{
+    auto it = table.find(name);
+    if (it != table.end()) {
+        return it->second;
+    }
+    size_t id = table.size();
+    table[name] = id;
+    return id;
+}
+
+NabtoDeviceError CompiledIam::checkAction(NabtoDevice* device, NabtoDeviceConnectionRef connectionRef, const std::string& action, const json& attributes)
+{
+    std::vector<Attribute> typed;
+    for (auto it = attributes.begin(); it != attributes.end(); it++) {
+        if (it->is_string()) {
+            typed.push_back(Attribute(attributeId(it.key()), it->get_ref<const std::string&>().c_str()));
+        } else if (it->is_number()) {
+            typed.push_back(Attribute(attributeId(it.key()), it->get<double>()));
+        }
+    }
+    return checkAction(device, connectionRef, actionId(action), typed.data(), typed.size());
+}
+
+NabtoDeviceError CompiledIam::checkAction(NabtoDevice* device, NabtoDeviceConnectionRef connectionRef, ActionId action, const Attribute* attributes, size_t attributesCount)
+{
+    // The state keeps the grant alive while it is evaluated.
+    std::shared_ptr<const State> state;
+    const Grant* grant = NULL;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        state = state_;
+        auto it = connections_.find(connectionRef);
+        if (it != connections_.end()) {
+            ConnectionGrant& cached = it->second;
+            if (cached.state != state) {
+                // a new state has been loaded since the grant was resolved.
+                cached.state = state;
+                cached.grant = resolveGrant(*state, cached.fingerprint);
+            }
+            grant = cached.grant;
+        }
+    }
+
+    if (grant == NULL) {
+        char* fp;
+        if (nabto_device_connection_get_client_fingerprint_hex(device, connectionRef, &fp) == NABTO_DEVICE_EC_OK) {
+            std::string fingerprint(fp);
+            nabto_device_string_free(fp);
+            std::unique_lock<std::mutex> lock(mutex_);
+            state = state_;
+            ConnectionGrant& cached = connections_[connectionRef];
+            cached.fingerprint = fingerprint;
+            cached.state = state;
+            cached.grant = resolveGrant(*state, fingerprint);
+            grant = cached.grant;
+        } else {
+            grant = &state->defaultGrant;
+        }
+    }
+
+    if (testBit(grant->deny, action)) {
+        return NABTO_DEVICE_EC_IAM_DENY;
+    }
+    bool allowed = testBit(grant->allow, action);
+    for (const auto& statement : grant->conditional) {
+        if (!testBit(statement.actions, action)) {
+            continue;
+        }
+        if (!conditionsMatch(statement, *grant, attributes, attributesCount)) {
+            continue;
+        }
+        if (!statement.allow) {
+            return NABTO_DEVICE_EC_IAM_DENY;
+        }
+        allowed = true;
+    }
+    return allowed ? NABTO_DEVICE_EC_OK : NABTO_DEVICE_EC_IAM_DENY;
+}
+
+const CompiledIam::Grant* CompiledIam::resolveGrant(const State& state, const std::string& fingerprint)
+{
+    auto user = state.fingerprints.find(fingerprint);
+    if (user != state.fingerprints.end()) {
+        return user->second.get();
+    }
+    return &state.defaultGrant;
+}
+
+bool CompiledIam::isKnownFingerprint(const std::string& fingerprint)
+{
+    std::shared_ptr<const State> state;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        state = state_;
+    }
+    return state->fingerprints.find(fingerprint) != state->fingerprints.end();
+}
+
+void CompiledIam::connectionClosed(NabtoDeviceConnectionRef connectionRef)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    connections_.erase(connectionRef);
+}
+
+std::shared_ptr<const CompiledIam::State> CompiledIam::compile(const json& iam)
+{
+    auto state = std::make_shared<State>();
+
+    auto defaultRole = iam.find("DefaultRole");
+    if (defaultRole != iam.end()) {
+        addRole(state->defaultGrant, iam, defaultRole->get<std::string>());
+    }
+
+    auto users = iam.find("Users");
+    if (users != iam.end()) {
+        for (auto it = users->begin(); it != users->end(); it++) {
+            auto grant = std::make_shared<Grant>();
+            grant->userName = it.key();
+            auto roles = it->find("Roles");
+            if (roles != it->end()) {
+                for (const auto& role : *roles) {
+                    addRole(*grant, iam, role.get<std::string>());
+                }
+            }
+            auto fingerprints = it->find("Fingerprints");
+            if (fingerprints != it->end()) {
+                for (const auto& fingerprint : *fingerprints) {
+                    state->fingerprints[fingerprint.get<std::string>()] = grant;
+                }
+            }
+        }
+    }
+    return state;
+}
+
+void CompiledIam::addRole(Grant& grant, const json& iam, const std::string& roleName)
+{
+    const json& role = iam.at("Roles").at(roleName);
+    // A role is either a list of policy names or an object with a
+    // Policies list, see nabto_device_iam_roles_get.
+    const json& policies = role.is_array() ? role : role.at("Policies");
+
+    for (const auto& policyName : policies) {
+        const json& policy = iam.at("Policies").at(policyName.get<std::string>());
+        for (const auto& statement : policy.at("Statements")) {
+            bool allow = statement.at("Allow").get<bool>();
+            std::vector<uint64_t> actions;
+            for (const auto& action : statement.at("Actions")) {
+                setBit(actions, internLocked(actions_, action.get<std::string>()));
+            }
+
+            auto conditions = statement.find("Conditions");
+            if (conditions == statement.end() || conditions->empty()) {
+                std::vector<uint64_t>& target = allow ? grant.allow : grant.deny;
+                if (target.size() < actions.size()) {
+                    target.resize(actions.size());
+                }
+                for (size_t i = 0; i < actions.size(); i++) {
+                    target[i] |= actions[i];
+                }
+                continue;
+            }
+
+            ConditionalStatement conditional;
+            conditional.allow = allow;
+            conditional.actions = actions;
+            for (const auto& condition : *conditions) {
+                for (auto c = condition.begin(); c != condition.end(); c++) {
+                    for (auto a = c->begin(); a != c->end(); a++) {
+                        Condition compiled;
+                        compiled.attribute = internLocked(attributes_, a.key());
+                        compiled.other = 0;
+                        compiled.number = 0;
+                        if (c.key() == "StringEqual") {
+                            compiled.type = Condition::Type::STRING_EQUAL;
+                            compiled.string = a->get<std::string>();
+                        } else if (c.key() == "NumberEqual") {
+                            compiled.type = Condition::Type::NUMBER_EQUAL;
+                            compiled.number = a->get<double>();
+                        } else if (c.key() == "AttributeEqual") {
+                            compiled.type = Condition::Type::ATTRIBUTE_EQUAL;
+                            compiled.other = internLocked(attributes_, a->get<std::string>());
+                        } else {
+                            throw std::invalid_argument("unknown condition " + c.key());
+                        }
+                        conditional.conditions.push_back(compiled);
+                    }
+                }
+            }
+            grant.conditional.push_back(conditional);
+        }
+    }
+}
+
+const CompiledIam::Attribute* CompiledIam::findAttribute(AttributeId key, const Grant& grant, const Attribute* attributes, size_t attributesCount, Attribute& scratch)
+{
+    if (key == connectionUserId_) {
+        if (grant.userName.empty()) {
+            return NULL;
+        }
+        scratch = Attribute(key, grant.userName.c_str());
+        return &scratch;
+    }
+    for (size_t i = 0; i < attributesCount; i++) {
+        if (attributes[i].key == key) {
+            return &attributes[i];
+        }
+    }
+    return NULL;
+}
+
+bool CompiledIam::conditionsMatch(const ConditionalStatement& statement, const Grant& grant, const Attribute* attributes, size_t attributesCount)
+{
+    Attribute scratch(0, 0.0);
+    Attribute otherScratch(0, 0.0);
+    for (const auto& condition : statement.conditions) {
+        const Attribute* value = findAttribute(condition.attribute, grant, attributes, attributesCount, scratch);
+        if (value == NULL) {
+            return false;
+        }
+        switch (condition.type) {
+            case Condition::Type::STRING_EQUAL:
+                if (!value->isString || condition.string != value->string) {
+                    return false;
+                }
+                break;
+            case Condition::Type::NUMBER_EQUAL:
+                if (value->isString || value->number != condition.number) {
+                    return false;
+                }
+                break;
+            case Condition::Type::ATTRIBUTE_EQUAL: {
+                const Attribute* other = findAttribute(condition.other, grant, attributes, attributesCount, otherScratch);
+                if (other == NULL || other->isString != value->isString) {
+                    return false;
+                }
+                if (value->isString ? strcmp(value->string, other->string) != 0 : value->number != other->number) {
+                    return false;
+                }
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+void CompiledIam::setBit(std::vector<uint64_t>& bits, ActionId action)
+{
+    size_t word = action / 64;
+    if (bits.size() <= word) {
+        bits.resize(word + 1);
+    }
+    bits[word] |= ((uint64_t)1 << (action % 64));
+}
+
+bool CompiledIam::testBit(const std::vector<uint64_t>& bits, ActionId action)
+{
+    size_t word = action / 64;
+    if (word >= bits.size()) {
+        return false;
+    }
+    return (bits[word] & ((uint64_t)1 << (action % 64))) != 0;
+}
+
+} } // namespace
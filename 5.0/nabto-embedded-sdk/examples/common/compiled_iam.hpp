@@ -0,0 +1,180 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+
+#include <nlohmann/json.hpp>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nabto {
+namespace common {
+
+/**
+ * Application side evaluation of the IAM state which is loaded into
+ * the device.
+ *
+ * The IAM state, in the format of nabto_device_iam_dump and
+ * nabto_device_iam_load, is compiled into interned action ids and an
+ * allow and a deny bitset per user. Checking an action which is only
+ * covered by statements without conditions is a bit test. Statements
+ * with conditions are kept in a short list per user and are only
+ * evaluated for the actions they mention.
+ *
+ * The effect is the same as nabto_device_iam_check_action_attributes,
+ * a matching deny statement overrides any allow, and a connection
+ * whose fingerprint does not belong to a user gets the DefaultRole.
+ * The attribute Connection:UserId is set to the name of the user of
+ * the connection.
+ *
+ * load must be called again whenever the IAM state of the device
+ * changes. The evaluator does not follow the device by itself, changes
+ * made through the IAM endpoints of the core are only seen once the
+ * state is loaded again. An application which uses the evaluator as
+ * the authority should compare the IAM version of the device, see
+ * nabto_device_iam_dump, before each check and reload when it has
+ * changed.
+ */
+class CompiledIam {
+ public:
+    typedef size_t ActionId;
+    typedef size_t AttributeId;
+
+    /**
+     * An attribute for an access check. String values are not
+     * copied, they must outlive the check.
+     */
+    class Attribute {
+     public:
+        Attribute(AttributeId key, const char* value)
+            : key(key), isString(true), string(value), number(0)
+        {
+        }
+        Attribute(AttributeId key, double value)
+            : key(key), isString(false), string(NULL), number(value)
+        {
+        }
+        AttributeId key;
+        bool isString;
+        const char* string;
+        double number;
+    };
+
+    CompiledIam();
+
+    /**
+     * Compile the IAM state. If the state is invalid the error is
+     * logged, false is returned and all actions are denied until a
+     * valid state is loaded.
+     */
+    bool load(const nlohmann::json& iam);
+
+    /**
+     * Get the interned id of an action. Ids are stable across loads
+     * such that they can be looked up once by the application.
+     */
+    ActionId actionId(const std::string& action);
+
+    /**
+     * Get the interned id of an attribute name, stable across loads.
+     */
+    AttributeId attributeId(const std::string& attribute);
+
+    /**
+     * Check if the connection is allowed to perform the action.
+     *
+     * The fingerprint of the connection is looked up through the
+     * device the first time the connection is seen, so this must not
+     * be called from an iam override callback. The grant of the user
+     * is cached per connection, later checks are a map lookup and a
+     * bit test as long as the state is not reloaded.
+     *
+     * @param attributes  attributes used by conditions, the array is
+     *                    only read during the call.
+     * @return NABTO_DEVICE_EC_OK iff the action is allowed.
+     *         NABTO_DEVICE_EC_IAM_DENY otherwise.
+     */
+    NabtoDeviceError checkAction(NabtoDevice* device, NabtoDeviceConnectionRef connectionRef, ActionId action, const Attribute* attributes = NULL, size_t attributesCount = 0);
+
+    /**
+     * Same as above but with the attributes as a json object, as they
+     * would be given to nabto_device_iam_check_action_attributes.
+     */
+    NabtoDeviceError checkAction(NabtoDevice* device, NabtoDeviceConnectionRef connectionRef, const std::string& action, const nlohmann::json& attributes = nlohmann::json::object());
+
+    /**
+     * Return true if the fingerprint belongs to a user.
+     */
+    bool isKnownFingerprint(const std::string& fingerprint);
+
+    /**
+     * Forget the cached fingerprint of a closed connection.
+     */
+    void connectionClosed(NabtoDeviceConnectionRef connectionRef);
+
+ private:
+    struct Condition {
+        enum class Type {
+            STRING_EQUAL,
+            NUMBER_EQUAL,
+            ATTRIBUTE_EQUAL
+        };
+        Type type;
+        AttributeId attribute;
+        // the other attribute of an ATTRIBUTE_EQUAL condition
+        AttributeId other;
+        std::string string;
+        double number;
+    };
+
+    struct ConditionalStatement {
+        bool allow;
+        std::vector<uint64_t> actions;
+        std::vector<Condition> conditions;
+    };
+
+    // The effective permissions of a user, the union of the
+    // statements of all policies of all its roles.
+    struct Grant {
+        std::string userName;
+        std::vector<uint64_t> allow;
+        std::vector<uint64_t> deny;
+        std::vector<ConditionalStatement> conditional;
+    };
+
+    struct State {
+        std::unordered_map<std::string, std::shared_ptr<Grant> > fingerprints;
+        Grant defaultGrant;
+    };
+
+    // The grant of a connection, resolved again when a new state has
+    // been loaded.
+    struct ConnectionGrant {
+        std::string fingerprint;
+        std::shared_ptr<const State> state;
+        const Grant* grant = NULL;
+    };
+
+    std::shared_ptr<const State> compile(const nlohmann::json& iam);
+    static const Grant* resolveGrant(const State& state, const std::string& fingerprint);
+    void addRole(Grant& grant, const nlohmann::json& iam, const std::string& roleName);
+    bool conditionsMatch(const ConditionalStatement& statement, const Grant& grant, const Attribute* attributes, size_t attributesCount);
+    const Attribute* findAttribute(AttributeId key, const Grant& grant, const Attribute* attributes, size_t attributesCount, Attribute& scratch);
+    static void setBit(std::vector<uint64_t>& bits, ActionId action);
+    static bool testBit(const std::vector<uint64_t>& bits, ActionId action);
+
+    static size_t internLocked(std::unordered_map<std::string, size_t>& table, const std::string& name);
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, ActionId> actions_;
+    std::unordered_map<std::string, AttributeId> attributes_;
+    AttributeId connectionUserId_;
+    std::shared_ptr<const State> state_ = std::make_shared<State>();
+    std::map<NabtoDeviceConnectionRef, ConnectionGrant> connections_;
+};
+
+} } // namespace
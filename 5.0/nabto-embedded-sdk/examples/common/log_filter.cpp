@@ -0,0 +1,204 @@
+#include "log_filter.hpp"
+
+#include <sstream>
+
+#include <stdio.h>
+
+namespace nabto {
+namespace common {
+
+DeviceLogFilter::DeviceLogFilter()
+{
+    snapshot_ = new Snapshot();
+    readers_ = 0;
+}
+
+DeviceLogFilter::~DeviceLogFilter()
+{
+    delete snapshot_.load();
+}
+
+void DeviceLogFilter::publish(std::unique_ptr<Snapshot> snapshot)
+{
+    const Snapshot* old = snapshot_.exchange(snapshot.release());
+    retired_.push_back(std::unique_ptr<const Snapshot>(old));
+    reclaim();
+}
+
+void DeviceLogFilter::reclaim()
+{
+    // A log callback which starts after this sees no readers loads the
+    // snapshot which was just published, so no callback can hold a
+    // retired snapshot. Both sides use sequentially consistent order.
+    if (readers_.load() == 0) {
+        retired_.clear();
+    }
+}
+
+NabtoDeviceError DeviceLogFilter::apply(NabtoDevice* device, const std::string& spec)
+{
+    std::vector<Rule> rules;
+    uint32_t defaultMask = NABTO_DEVICE_LOG_FATAL | NABTO_DEVICE_LOG_ERROR;
+    uint32_t deviceMask = defaultMask;
+    const char* deviceLevel = "error";
+
+    std::stringstream ss(spec);
+    std::string entry;
+    while (std::getline(ss, entry, ',')) {
+        if (entry.empty()) {
+            continue;
+        }
+        uint32_t mask;
+        const char* name;
+        size_t eq = entry.find('=');
+        if (eq == std::string::npos) {
+            if (!parseLevel(entry, mask, name)) {
+                return NABTO_DEVICE_EC_INVALID_ARGUMENT;
+            }
+            defaultMask = mask;
+        } else {
+            Rule rule;
+            rule.module = entry.substr(0, eq);
+            if (rule.module.empty() || !parseLevel(entry.substr(eq+1), mask, name)) {
+                return NABTO_DEVICE_EC_INVALID_ARGUMENT;
+            }
+            rule.mask = mask;
+            rules.push_back(rule);
+        }
+        if (mask > deviceMask) {
+            deviceMask = mask;
+            deviceLevel = name;
+        }
+    }
+
+    {
+        std::unique_ptr<Snapshot> snapshot(new Snapshot());
+        snapshot->rules = rules;
+        snapshot->defaultMask = defaultMask;
+        std::unique_lock<std::mutex> lock(mutex_);
+        publish(std::move(snapshot));
+    }
+
+    NabtoDeviceError ec = nabto_device_set_log_level(device, deviceLevel);
+    if (ec) {
+        return ec;
+    }
+    return nabto_device_set_log_callback(device, &DeviceLogFilter::logCallback, this);
+}
+
+bool DeviceLogFilter::parseLevel(const std::string& level, uint32_t& mask, const char*& name)
+{
+    if (level == "error") {
+        mask = NABTO_DEVICE_LOG_FATAL | NABTO_DEVICE_LOG_ERROR;
+        name = "error";
+    } else if (level == "warn") {
+        mask = NABTO_DEVICE_LOG_FATAL | NABTO_DEVICE_LOG_ERROR | NABTO_DEVICE_LOG_WARN;
+        name = "warn";
+    } else if (level == "info") {
+        mask = NABTO_DEVICE_LOG_FATAL | NABTO_DEVICE_LOG_ERROR | NABTO_DEVICE_LOG_WARN | NABTO_DEVICE_LOG_INFO;
+        name = "info";
+    } else if (level == "trace" || level == "debug") {
+        mask = NABTO_DEVICE_LOG_FATAL | NABTO_DEVICE_LOG_ERROR | NABTO_DEVICE_LOG_WARN | NABTO_DEVICE_LOG_INFO | NABTO_DEVICE_LOG_TRACE;
+        name = "trace";
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void DeviceLogFilter::logCallback(NabtoDeviceLogMessage* msg, void* data)
+{
+    DeviceLogFilter* self = (DeviceLogFilter*)data;
+    if (!self->enabled(msg->file, msg->severity)) {
+        return;
+    }
+
+    const char* level;
+    switch (msg->severity) {
+        case NABTO_DEVICE_LOG_FATAL: level = "FATAL"; break;
+        case NABTO_DEVICE_LOG_ERROR: level = "ERROR"; break;
+        case NABTO_DEVICE_LOG_WARN: level = "WARN"; break;
+        case NABTO_DEVICE_LOG_INFO: level = "INFO"; break;
+        default: level = "TRACE"; break;
+    }
+
+    const char* file = msg->file ? msg->file : "";
+    for (const char* p = file; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            file = p + 1;
+        }
+    }
+    printf("%s(%d)[%s] %s\n", file, msg->line, level, msg->message);
+}
+
+bool DeviceLogFilter::enabled(const char* file, NabtoDeviceLogLevel severity)
+{
+    uint32_t mask = 0;
+    bool known;
+    readers_++;
+    {
+        const Snapshot* snapshot = snapshot_.load();
+        auto it = snapshot->fileMasks.find(file);
+        known = it != snapshot->fileMasks.end();
+        if (known) {
+            mask = it->second;
+        }
+    }
+    readers_--;
+    if (!known) {
+        // learnFile publishes a new snapshot, the old one must not be
+        // held meanwhile.
+        mask = learnFile(file);
+    }
+    return (mask & severity) != 0;
+}
+
+uint32_t DeviceLogFilter::learnFile(const char* file)
+{
+    // Copy on write, this happens once per source file.
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Only writers free snapshots, so the current one stays valid
+    // while the lock is held.
+    const Snapshot* current = snapshot_.load();
+    auto it = current->fileMasks.find(file);
+    if (it != current->fileMasks.end()) {
+        return it->second;
+    }
+    uint32_t mask = maskForFile(*current, file);
+    std::unique_ptr<Snapshot> snapshot(new Snapshot(*current));
+    snapshot->fileMasks[file] = mask;
+    publish(std::move(snapshot));
+    return mask;
+}
+
+uint32_t DeviceLogFilter::maskForFile(const Snapshot& snapshot, const char* file)
+{
+    if (file == NULL) {
+        return snapshot.defaultMask;
+    }
+    std::vector<std::string> directories;
+    std::string component;
+    for (const char* p = file; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            directories.push_back(component);
+            component.clear();
+        } else {
+            component.push_back(*p);
+        }
+    }
+    std::string fileName = component.substr(0, component.find('.'));
+
+    for (const auto& rule : snapshot.rules) {
+        for (const auto& directory : directories) {
+            if (directory == rule.module) {
+                return rule.mask;
+            }
+        }
+        if (fileName.find(rule.module) != std::string::npos) {
+            return rule.mask;
+        }
+    }
+    return snapshot.defaultMask;
+}
+
+} } // namespace
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nabto {
+namespace common {
+
+/**
+ * Per module log levels for a device.
+ *
+ * A level spec is a comma separated list of entries. An entry is
+ * either a level, which becomes the level of messages which does not
+ * match any module, or module=level. E.g.
+ *
+ *   "error,stream=trace,dtls=info"
+ *
+ * A module matches a log message if it is the name of a directory in
+ * the path of the source file which logged the message, or if it is
+ * part of the file name. So "dtls" matches src/modules/dtls/nm_dtls_srv.c
+ * and "stream" matches src/core/nc_stream.c. The first matching entry
+ * is used. Levels are error, warn, info and trace, debug is accepted
+ * as trace.
+ *
+ * The device log level is set to the most verbose level in the spec,
+ * messages above that level are discarded by the core before they are
+ * formatted. Messages at or below it are formatted by the core for
+ * every module and then dropped here if their module does not want
+ * them, at the cost of a hash lookup of the source file. So with
+ * "error,stream=trace" every trace message of the device is
+ * formatted, which costs more than a plain "error" level. Only raise
+ * a module to a verbose level while it is being debugged.
+ *
+ * The level of each source file is computed once and published in an
+ * immutable snapshot, the log callback reads the current snapshot
+ * without taking a lock. Replaced snapshots are freed by the next
+ * writer which sees no log callback in progress.
+ *
+ * The filter must outlive the device, as the core invokes its log
+ * callback until the device is freed.
+ */
+class DeviceLogFilter {
+ public:
+    DeviceLogFilter();
+    ~DeviceLogFilter();
+
+    /**
+     * Apply a level spec to the device. Can be called again at
+     * runtime to change the levels.
+     *
+     * @return NABTO_DEVICE_EC_OK if the spec was applied.
+     *         NABTO_DEVICE_EC_INVALID_ARGUMENT if the spec is invalid.
+     */
+    NabtoDeviceError apply(NabtoDevice* device, const std::string& spec);
+
+ private:
+    struct Rule {
+        std::string module;
+        uint32_t mask;
+    };
+
+    struct Snapshot {
+        std::vector<Rule> rules;
+        uint32_t defaultMask = 0;
+        // source file names are static strings in the core so the
+        // pointer identifies the file.
+        std::unordered_map<const char*, uint32_t> fileMasks;
+    };
+
+    static void logCallback(NabtoDeviceLogMessage* msg, void* data);
+    bool enabled(const char* file, NabtoDeviceLogLevel severity);
+    uint32_t learnFile(const char* file);
+    static uint32_t maskForFile(const Snapshot& snapshot, const char* file);
+    void publish(std::unique_ptr<Snapshot> snapshot);
+    void reclaim();
+
+    static bool parseLevel(const std::string& level, uint32_t& mask, const char*& name);
+
+    std::atomic<const Snapshot*> snapshot_;
+    // log callbacks currently reading a snapshot
+    std::atomic<int> readers_;
+    // Serializes writers and guards the replaced snapshots which may
+    // still be read by a log callback.
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<const Snapshot> > retired_;
+};
+
+} } // namespace
@@ -0,0 +1,176 @@
+#include "message_stream.hpp"
+
+namespace nabto {
+namespace common {
+
+static const size_t MESSAGE_HEADER_SIZE = 4;
+
+MessageStream::MessageStream(NabtoDevice* device, NabtoDeviceStream* stream, size_t maxMessageSize)
+    : device_(device), stream_(stream), maxMessageSize_(maxMessageSize)
+{
+    readFuture_ = nabto_device_future_new(device);
+    writeFuture_ = nabto_device_future_new(device);
+}
+
+MessageStream::~MessageStream()
+{
+    nabto_device_future_free(readFuture_);
+    nabto_device_future_free(writeFuture_);
+}
+
+void MessageStream::start(MessageHandler messageHandler, MessageStreamClosedHandler closedHandler)
+{
+    messageHandler_ = messageHandler;
+    closedHandler_ = closedHandler;
+    if (!readFuture_ || !writeFuture_) {
+        readStopped(NABTO_DEVICE_EC_OUT_OF_MEMORY);
+        return;
+    }
+    startReadHeader();
+}
+
+void MessageStream::send(const uint8_t* message, size_t messageLength, std::chrono::milliseconds deadline)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (readStopped_) {
+            return;
+        }
+        PendingMessage pending;
+        pending.data = std::vector<uint8_t>(message, message + messageLength);
+        pending.hasDeadline = deadline.count() > 0;
+        pending.deadline = std::chrono::steady_clock::now() + deadline;
+        sendQueue_.push_back(std::move(pending));
+        if (writing_) {
+            // the message is written when the current write completes.
+            return;
+        }
+        writing_ = true;
+    }
+    startWrite();
+}
+
+size_t MessageStream::droppedCount()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return dropped_;
+}
+
+void MessageStream::startReadHeader()
+{
+    nabto_device_stream_read_all(stream_, readFuture_, header_, MESSAGE_HEADER_SIZE, &readLength_);
+    nabto_device_future_set_callback(readFuture_, &MessageStream::headerRead, this);
+}
+
+void MessageStream::headerRead(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+{
+    MessageStream* self = (MessageStream*)userData;
+    if (ec != NABTO_DEVICE_EC_OK) {
+        self->readStopped(ec);
+        return;
+    }
+    size_t length = ((size_t)self->header_[0] << 24) | ((size_t)self->header_[1] << 16) | ((size_t)self->header_[2] << 8) | (size_t)self->header_[3];
+    if (length > self->maxMessageSize_) {
+        // The stream cannot be resynchronized.
+        nabto_device_stream_abort(self->stream_);
+        self->readStopped(NABTO_DEVICE_EC_OUT_OF_MEMORY);
+        return;
+    }
+    if (length == 0) {
+        self->messageHandler_(NULL, 0);
+        self->startReadHeader();
+        return;
+    }
+    self->body_.resize(length);
+    self->startReadBody();
+}
+
+void MessageStream::startReadBody()
+{
+    nabto_device_stream_read_all(stream_, readFuture_, body_.data(), body_.size(), &readLength_);
+    nabto_device_future_set_callback(readFuture_, &MessageStream::bodyRead, this);
+}
+
+void MessageStream::bodyRead(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+{
+    MessageStream* self = (MessageStream*)userData;
+    if (ec != NABTO_DEVICE_EC_OK) {
+        self->readStopped(ec);
+        return;
+    }
+    self->messageHandler_(self->body_.data(), self->body_.size());
+    self->startReadHeader();
+}
+
+void MessageStream::startWrite()
+{
+    bool closed = false;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        while (!sendQueue_.empty() && sendQueue_.front().hasDeadline && sendQueue_.front().deadline < now) {
+            sendQueue_.pop_front();
+            dropped_++;
+        }
+        if (sendQueue_.empty()) {
+            writing_ = false;
+            closed = readStopped_;
+        } else {
+            PendingMessage& next = sendQueue_.front();
+            size_t length = next.data.size();
+            writeBuffer_.resize(MESSAGE_HEADER_SIZE + length);
+            writeBuffer_[0] = (uint8_t)(length >> 24);
+            writeBuffer_[1] = (uint8_t)(length >> 16);
+            writeBuffer_[2] = (uint8_t)(length >> 8);
+            writeBuffer_[3] = (uint8_t)(length);
+            std::copy(next.data.begin(), next.data.end(), writeBuffer_.begin() + MESSAGE_HEADER_SIZE);
+            sendQueue_.pop_front();
+        }
+    }
+    if (closed) {
+        closedHandler_(readError_);
+        return;
+    }
+    nabto_device_stream_write(stream_, writeFuture_, writeBuffer_.data(), writeBuffer_.size());
+    nabto_device_future_set_callback(writeFuture_, &MessageStream::written, this);
+}
+
+void MessageStream::written(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+{
+    MessageStream* self = (MessageStream*)userData;
+    if (ec == NABTO_DEVICE_EC_OK) {
+        self->startWrite();
+        return;
+    }
+    bool closed;
+    {
+        std::unique_lock<std::mutex> lock(self->mutex_);
+        self->sendQueue_.clear();
+        self->writing_ = false;
+        closed = self->readStopped_;
+    }
+    if (closed) {
+        self->closedHandler_(self->readError_);
+    }
+}
+
+void MessageStream::readStopped(NabtoDeviceError ec)
+{
+    bool closed;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        readStopped_ = true;
+        readError_ = ec;
+        if (ec != NABTO_DEVICE_EC_EOF) {
+            // After an error the queued messages cannot be delivered,
+            // after an end of file they are still written.
+            sendQueue_.clear();
+        }
+        closed = !writing_;
+    }
+    if (closed) {
+        closedHandler_(ec);
+    }
+}
+
+} } // namespace
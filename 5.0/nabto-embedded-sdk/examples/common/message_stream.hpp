@@ -0,0 +1,90 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace nabto {
+namespace common {
+
+typedef std::function<void (const uint8_t* message, size_t messageLength)> MessageHandler;
+typedef std::function<void (NabtoDeviceError ec)> MessageStreamClosedHandler;
+
+/**
+ * Message oriented channel on top of an accepted nabto stream.
+ *
+ * Each message is framed with a 4 byte big endian length, the same
+ * framing as the client side MessageStream. Messages can be given a
+ * deadline, a message which is still waiting in the send queue when
+ * its deadline passes is dropped instead of being written.
+ *
+ * The stream is owned by the caller. The MessageStream must not be
+ * destroyed before the closed handler has been invoked, abort the
+ * stream to stop it.
+ */
+class MessageStream {
+ public:
+    MessageStream(NabtoDevice* device, NabtoDeviceStream* stream, size_t maxMessageSize = 65536);
+    ~MessageStream();
+
+    /**
+     * Start reading messages. The message handler is invoked for each
+     * received message. The closed handler is invoked once when the
+     * stream is no longer readable and no write is outstanding. If
+     * the stream was closed by the peer the queued messages are
+     * written first, on errors they are discarded.
+     */
+    void start(MessageHandler messageHandler, MessageStreamClosedHandler closedHandler);
+
+    /**
+     * Queue a message for sending. A deadline of zero means the
+     * message is never dropped.
+     */
+    void send(const uint8_t* message, size_t messageLength, std::chrono::milliseconds deadline = std::chrono::milliseconds(0));
+
+    size_t droppedCount();
+
+ private:
+    struct PendingMessage {
+        std::vector<uint8_t> data;
+        std::chrono::steady_clock::time_point deadline;
+        bool hasDeadline;
+    };
+
+    void startReadHeader();
+    void startReadBody();
+    void startWrite();
+    void readStopped(NabtoDeviceError ec);
+
+    static void headerRead(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData);
+    static void bodyRead(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData);
+    static void written(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData);
+
+    NabtoDevice* device_;
+    NabtoDeviceStream* stream_;
+    size_t maxMessageSize_;
+
+    MessageHandler messageHandler_;
+    MessageStreamClosedHandler closedHandler_;
+
+    NabtoDeviceFuture* readFuture_;
+    uint8_t header_[4];
+    std::vector<uint8_t> body_;
+    size_t readLength_;
+
+    NabtoDeviceFuture* writeFuture_;
+    std::vector<uint8_t> writeBuffer_;
+
+    std::mutex mutex_;
+    std::deque<PendingMessage> sendQueue_;
+    bool writing_ = false;
+    bool readStopped_ = false;
+    NabtoDeviceError readError_ = NABTO_DEVICE_EC_OK;
+    size_t dropped_ = 0;
+};
+
+} } // namespace
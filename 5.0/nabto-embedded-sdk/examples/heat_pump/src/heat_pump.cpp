@@ -1,4 +1,5 @@
 #include "heat_pump.hpp"
+#include "heat_pump_coap.hpp"
 #include "json_config.hpp"
 
 #include <nabto/nabto_device.h>
@@ -9,9 +10,24 @@
 #include <iostream>
 
 void HeatPump::init() {
+    reloadIam();
+    // Optional limit on the connections which get coap answers, see README.md
+    size_t maxConnections = 0;
+    size_t reservedConnections = 0;
+    auto max = config_.find("CoapMaxConnections");
+    if (max != config_.end()) {
+        maxConnections = max->get<size_t>();
+    }
+    auto reserved = config_.find("CoapReservedConnections");
+    if (reserved != config_.end()) {
+        reservedConnections = reserved->get<size_t>();
+    }
+    coapConnectionLimit_.setLimits(maxConnections, reservedConnections);
+
     listenForIamChanges();
     listenForConnectionEvents();
     listenForDeviceEvents();
+    observerTimer_ = std::thread(&HeatPump::expireObservers, this);
 }
 
 bool validate_config(const json& config) {
@@ -31,19 +47,16 @@ bool validate_config(const json& config) {
 
 void HeatPump::setMode(Mode mode)
 {
-    config_["HeatPump"]["Mode"] = modeToString(mode);
-    saveConfig();
+    setState("Mode", modeToString(mode));
 }
 void HeatPump::setTarget(double target)
 {
-    config_["HeatPump"]["Target"] = target;
-    saveConfig();
+    setState("Target", target);
 }
 
 void HeatPump::setPower(bool power)
 {
-    config_["HeatPump"]["Power"] = power;
-    saveConfig();
+    setState("Power", power);
 }
 
 const char* HeatPump::modeToString(HeatPump::Mode mode)
@@ -64,34 +77,83 @@ void HeatPump::iamChanged(NabtoDeviceFuture* fut, NabtoDeviceError err, void* us
         return;
     }
     HeatPump* hp = (HeatPump*)userData;
+    hp->reloadIam();
     hp->saveConfig();
     hp->listenForIamChanges();
 }
 
 void HeatPump::listenForIamChanges()
 {
-    nabto_device_iam_listen_for_changes(device_, iamChangedFuture_, currentIamVersion_);
+    uint64_t version;
+    {
+        std::unique_lock<std::mutex> lock(iamMutex_);
+        version = currentIamVersion_;
+    }
+    nabto_device_iam_listen_for_changes(device_, iamChangedFuture_, version);
     nabto_device_future_set_callback(iamChangedFuture_, HeatPump::iamChanged, this);
 }
 
-void HeatPump::saveConfig()
+bool HeatPump::dumpIam(json& iam, uint64_t& version)
 {
-    json config = config_;
+    size_t used;
+    if (nabto_device_iam_dump(device_, &version, NULL, 0, &used) != NABTO_DEVICE_EC_OUT_OF_MEMORY) {
+        return false;
+    }
+
+    std::vector<uint8_t> buffer(used);
+    if(nabto_device_iam_dump(device_, &version, buffer.data(), buffer.size(), &used) != NABTO_DEVICE_EC_OK) {
+        return false;
+    }
+    iam = json::from_cbor(buffer);
+    return true;
+}
 
+void HeatPump::syncIam()
+{
+    // Only the version is read, the size query does not copy the
+    // state out of the device.
     uint64_t version;
     size_t used;
     if (nabto_device_iam_dump(device_, &version, NULL, 0, &used) != NABTO_DEVICE_EC_OUT_OF_MEMORY) {
         return;
     }
+    {
+        std::unique_lock<std::mutex> lock(iamMutex_);
+        if (version == currentIamVersion_) {
+            return;
+        }
+    }
+    reloadIam();
+}
 
-    std::vector<uint8_t> buffer(used);
-    if(nabto_device_iam_dump(device_, &version, buffer.data(), buffer.size(), &used) != NABTO_DEVICE_EC_OK) {
+void HeatPump::reloadIam()
+{
+    std::unique_lock<std::mutex> lock(iamMutex_);
+    json iam;
+    uint64_t version;
+    if (!dumpIam(iam, version)) {
         return;
     }
-    config["Iam"] = json::from_cbor(buffer);
+    if (version == currentIamVersion_ && !iamConfig_.is_null()) {
+        return;
+    }
+    iam_.load(iam);
+    iamConfig_ = iam;
     currentIamVersion_ = version;
+}
+
+void HeatPump::saveConfig()
+{
+    json config;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        config = config_;
+    }
+    {
+        std::unique_lock<std::mutex> lock(iamMutex_);
+        config["Iam"] = iamConfig_;
+    }
 
-    std::string tmpFile = "tmp.json";
     json_config_save(configFile_, config);
     std::cout << "Configuration saved to file" << std::endl;
 }
@@ -111,8 +173,12 @@ void HeatPump::connectionEvent(NabtoDeviceFuture* fut, NabtoDeviceError err, voi
     } else {
         if (hp->connectionEvent_ == NABTO_DEVICE_CONNECTION_EVENT_OPENED) {
             std::cout << "New connection opened with reference: " << hp->connectionRef_ << std::endl;
+            hp->connectionOpened(hp->connectionRef_);
         } else if (hp->connectionEvent_ == NABTO_DEVICE_CONNECTION_EVENT_CLOSED) {
             std::cout << "Connection with reference: " << hp->connectionRef_ << " was closed" << std::endl;
+            hp->removeObservers(hp->connectionRef_);
+            hp->iam_.connectionClosed(hp->connectionRef_);
+            hp->coapConnectionLimit_.connectionClosed(hp->connectionRef_);
         } else if (hp->connectionEvent_ == NABTO_DEVICE_CONNECTION_EVENT_CHANNEL_CHANGED) {
             std::cout << "Connection with reference: " << hp->connectionRef_ << " changed channel" << std::endl;
         } else {
@@ -123,6 +189,30 @@ void HeatPump::connectionEvent(NabtoDeviceFuture* fut, NabtoDeviceError err, voi
 
 }
 
+bool HeatPump::isKnownClient(NabtoDeviceConnectionRef connectionRef)
+{
+    bool known = false;
+    char* fp;
+    if (nabto_device_connection_get_client_fingerprint_hex(device_, connectionRef, &fp) == NABTO_DEVICE_EC_OK) {
+        known = iam_.isKnownFingerprint(std::string(fp));
+        nabto_device_string_free(fp);
+    }
+    return known;
+}
+
+bool HeatPump::isAdmitted(NabtoDeviceConnectionRef connectionRef)
+{
+    return coapConnectionLimit_.admit(connectionRef, [this, connectionRef]() { return isKnownClient(connectionRef); });
+}
+
+void HeatPump::connectionOpened(NabtoDeviceConnectionRef connectionRef)
+{
+    if (!isAdmitted(connectionRef)) {
+        auto stats = coapConnectionLimit_.getStats();
+        std::cout << "Connection with reference: " << connectionRef << " is beyond the coap connection limit, its requests are answered with 503 until a slot is free. Rejected requests from known clients: " << stats.rejectedKnown << " unknown clients: " << stats.rejectedUnknown << std::endl;
+    }
+}
+
 void HeatPump::listenForConnectionEvents()
 {
     NabtoDeviceError ec = nabto_device_connection_events_init_listener(device_, connectionEventListener_);
@@ -168,3 +258,112 @@ void HeatPump::listenForDeviceEvents()
     }
     startWaitDevEvent();
 }
+
+HeatPump::ObserveResult HeatPump::addObserver(NabtoDeviceCoapRequest* request, uint64_t knownVersion, uint64_t& version, json& state)
+{
+    NabtoDeviceCoapRequest* replaced = NULL;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        version = stateVersion_;
+        state = config_["HeatPump"];
+        if (knownVersion != stateVersion_) {
+            return ObserveResult::CHANGED;
+        }
+        Observer parked;
+        parked.request = request;
+        parked.parkedAt = std::chrono::steady_clock::now();
+        // A connection only needs one outstanding observe request, an
+        // older one has most likely been given up by the client.
+        NabtoDeviceConnectionRef ref = nabto_device_coap_request_get_connection_ref(request);
+        for (auto& observer : observers_) {
+            if (nabto_device_coap_request_get_connection_ref(observer.request) == ref) {
+                replaced = observer.request;
+                observer = parked;
+                break;
+            }
+        }
+        if (replaced == NULL) {
+            if (observers_.size() >= maxObservers_) {
+                return ObserveResult::FULL;
+            }
+            observers_.push_back(parked);
+        }
+    }
+    if (replaced) {
+        heat_pump_coap_send_observed_state(replaced, version, state);
+    }
+    return ObserveResult::PARKED;
+}
+
+void HeatPump::removeObservers(NabtoDeviceConnectionRef connectionRef)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = observers_.begin();
+    while (it != observers_.end()) {
+        if (nabto_device_coap_request_get_connection_ref(it->request) == connectionRef) {
+            nabto_device_coap_request_free(it->request);
+            it = observers_.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+void HeatPump::removeAllObservers()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto observer : observers_) {
+        nabto_device_coap_error_response(observer.request, 503, "Shutting down");
+        nabto_device_coap_request_free(observer.request);
+    }
+    observers_.clear();
+}
+
+void HeatPump::expireObservers()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        observerTimerCond_.wait_for(lock, std::chrono::seconds(1));
+        auto expired = std::chrono::steady_clock::now() - maxObserveWait_;
+        auto it = observers_.begin();
+        while (it != observers_.end()) {
+            if (it->parkedAt <= expired) {
+                heat_pump_coap_send_not_modified(it->request);
+                it = observers_.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+}
+
+void HeatPump::stopObserverTimer()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    observerTimerCond_.notify_all();
+    if (observerTimer_.joinable()) {
+        observerTimer_.join();
+    }
+}
+
+void HeatPump::setState(const std::string& key, const json& value)
+{
+    std::vector<Observer> observers;
+    uint64_t version;
+    json state;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        config_["HeatPump"][key] = value;
+        stateVersion_++;
+        version = stateVersion_;
+        state = config_["HeatPump"];
+        observers.swap(observers_);
+    }
+    saveConfig();
+    for (auto observer : observers) {
+        heat_pump_coap_send_observed_state(observer.request, version, state);
+    }
+}
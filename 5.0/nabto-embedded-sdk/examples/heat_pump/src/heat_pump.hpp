@@ -4,8 +4,13 @@
 #include <nabto/nabto_device.h>
 #include <nabto/nabto_device_experimental.h>
 
+#include <compiled_iam.hpp>
+#include <coap_connection_limit.hpp>
+
 #include <nlohmann/json.hpp>
 
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <thread>
 #include <sstream>
@@ -66,6 +71,7 @@ class HeatPump {
     }
 
     ~HeatPump() {
+        stopObserverTimer();
         nabto_device_future_free(connectionEventFuture_);
         nabto_device_future_free(deviceEventFuture_);
         nabto_device_future_free(iamChangedFuture_);
@@ -83,6 +89,7 @@ class HeatPump {
         if (deviceEventListener_) {
             nabto_device_listener_stop(deviceEventListener_);
         }
+        stopObserverTimer();
     }
 
     enum class Mode {
@@ -97,15 +104,71 @@ class HeatPump {
         return device_;
     }
 
+    /**
+     * Check an action against the compiled IAM state. The state is
+     * recompiled first if the IAM version of the device has changed,
+     * such that a user removed through the IAM endpoints of the core
+     * is denied right away and not when the change listener fires.
+     */
+    NabtoDeviceError checkAction(NabtoDeviceConnectionRef connectionRef, const std::string& action, const json& attributes = json::object()) {
+        syncIam();
+        return iam_.checkAction(device_, connectionRef, action, attributes);
+    }
+
+    NabtoDeviceError checkAction(NabtoDeviceConnectionRef connectionRef, nabto::common::CompiledIam::ActionId action, const nabto::common::CompiledIam::Attribute* attributes, size_t attributesCount) {
+        syncIam();
+        return iam_.checkAction(device_, connectionRef, action, attributes, attributesCount);
+    }
+
+    nabto::common::CompiledIam& getIam() {
+        return iam_;
+    }
+
+    /**
+     * Recompile the IAM state from the device. Call after the
+     * application has changed the IAM state.
+     */
+    void reloadIam();
+
+    /**
+     * Return false if the coap requests of the connection should be
+     * answered with 503, see CoapConnectionLimit.
+     */
+    bool isAdmitted(NabtoDeviceConnectionRef connectionRef);
+
     void setMode(Mode mode);
     void setTarget(double target);
     void setPower(bool on);
     const char* modeToString(HeatPump::Mode mode);
     const char* getModeString();
     json getState() {
+        std::unique_lock<std::mutex> lock(mutex_);
         return config_["HeatPump"];
     }
 
+    enum class ObserveResult {
+        PARKED,
+        CHANGED,
+        FULL
+    };
+
+    /**
+     * Park an observe request until the state changes from
+     * knownVersion, or until it has been parked for maxObserveWait_
+     * and is answered with 2.03 not modified. If the state has
+     * already changed the current version and state are returned
+     * together with CHANGED. If the state has changed or too many
+     * observers are parked the request is not parked, and the caller
+     * must respond to it.
+     */
+    ObserveResult addObserver(NabtoDeviceCoapRequest* request, uint64_t knownVersion, uint64_t& version, json& state);
+
+    /**
+     * Release all observe requests from a connection which has closed.
+     */
+    void removeObservers(NabtoDeviceConnectionRef connectionRef);
+    void removeAllObservers();
+
     bool beginPairing() {
         std::unique_lock<std::mutex> lock(mutex_);
         if (pairing_) {
@@ -159,11 +222,15 @@ class HeatPump {
     std::unique_ptr<std::thread> pairingThread_;
 
     std::unique_ptr<HeatPumpCoapRequestHandler> coapGetState;
+    std::unique_ptr<HeatPumpCoapRequestHandler> coapGetObserveState;
     std::unique_ptr<HeatPumpCoapRequestHandler> coapPostPower;
     std::unique_ptr<HeatPumpCoapRequestHandler> coapPostMode;
     std::unique_ptr<HeatPumpCoapRequestHandler> coapPostTarget;
     std::unique_ptr<HeatPumpCoapRequestHandler> coapPostPairingButton;
 
+    nabto::common::CompiledIam::ActionId pairingButtonAction;
+    nabto::common::CompiledIam::AttributeId pairingUserCountAttribute;
+
   private:
 
     static void iamChanged(NabtoDeviceFuture* fut, NabtoDeviceError err, void* userData);
@@ -178,13 +245,41 @@ class HeatPump {
     void startWaitDevEvent();
 
     void saveConfig();
+    bool dumpIam(json& iam, uint64_t& version);
+    void syncIam();
+    void setState(const std::string& key, const json& value);
+    void expireObservers();
+    void stopObserverTimer();
+    void connectionOpened(NabtoDeviceConnectionRef connectionRef);
+    bool isKnownClient(NabtoDeviceConnectionRef connectionRef);
 
     std::mutex mutex_;
     NabtoDevice* device_;
     json config_;
     const std::string& configFile_;
     bool pairing_ = false;
-    uint64_t currentIamVersion_;
+    // guards the IAM version and dumped IAM state, and serializes reloads.
+    std::mutex iamMutex_;
+    uint64_t currentIamVersion_ = 0;
+    json iamConfig_;
+    nabto::common::CompiledIam iam_;
+    nabto::common::CoapConnectionLimit coapConnectionLimit_;
+
+    struct Observer {
+        NabtoDeviceCoapRequest* request;
+        std::chrono::steady_clock::time_point parkedAt;
+    };
+
+    // config_ and the observers are guarded by mutex_
+    uint64_t stateVersion_ = 1;
+    std::vector<Observer> observers_;
+    const size_t maxObservers_ = 32;
+    // Shorter than the coap timeout of the client such that an
+    // observe request is answered before the client gives up on it.
+    const std::chrono::seconds maxObserveWait_ = std::chrono::seconds(20);
+    std::thread observerTimer_;
+    std::condition_variable observerTimerCond_;
+    bool stopping_ = false;
 
     NabtoDeviceListener* connectionEventListener_;
     NabtoDeviceFuture* connectionEventFuture_;
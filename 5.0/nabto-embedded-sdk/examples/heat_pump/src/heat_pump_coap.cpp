@@ -17,6 +17,7 @@ void heat_pump_set_power(NabtoDeviceCoapRequest* request, void* userData);
 void heat_pump_set_mode(NabtoDeviceCoapRequest* request, void* userData);
 void heat_pump_set_target(NabtoDeviceCoapRequest* request, void* userData);
 void heat_pump_get(NabtoDeviceCoapRequest* request, void* userData);
+void heat_pump_observe(NabtoDeviceCoapRequest* request, void* userData);
 void heat_pump_pairing_button(NabtoDeviceCoapRequest* request, void* userData);
 
 
@@ -41,11 +42,16 @@ void HeatPumpCoapRequestHandler::startListen()
 void heat_pump_coap_init(NabtoDevice* device, HeatPump* heatPump)
 {
     const char* getState[] = { "heat-pump", NULL };
+    const char* getObserveState[] = { "heat-pump", "observe", "{version}", NULL };
     const char* postPower[] = { "heat-pump", "power", NULL };
     const char* postMode[] = { "heat-pump", "mode", NULL };
     const char* postTarget[] = { "heat-pump", "target", NULL };
     const char* postPairingButton[] = { "pairing", "button", NULL };
+    heatPump->pairingButtonAction = heatPump->getIam().actionId("Pairing:Button");
+    heatPump->pairingUserCountAttribute = heatPump->getIam().attributeId("Pairing:UserCount");
+
     heatPump->coapGetState = std::make_unique<HeatPumpCoapRequestHandler>(heatPump, NABTO_DEVICE_COAP_GET, getState, &heat_pump_get);
+    heatPump->coapGetObserveState = std::make_unique<HeatPumpCoapRequestHandler>(heatPump, NABTO_DEVICE_COAP_GET, getObserveState, &heat_pump_observe);
     heatPump->coapPostPower = std::make_unique<HeatPumpCoapRequestHandler>(heatPump, NABTO_DEVICE_COAP_POST, postPower, &heat_pump_set_power);
     heatPump->coapPostMode = std::make_unique<HeatPumpCoapRequestHandler>(heatPump, NABTO_DEVICE_COAP_POST, postMode, &heat_pump_set_mode);
     heatPump->coapPostTarget = std::make_unique<HeatPumpCoapRequestHandler>(heatPump, NABTO_DEVICE_COAP_POST, postTarget, &heat_pump_set_target);
@@ -55,10 +61,12 @@ void heat_pump_coap_init(NabtoDevice* device, HeatPump* heatPump)
 void heat_pump_coap_deinit(HeatPump* heatPump)
 {
     heatPump->coapGetState->stopListen();
+    heatPump->coapGetObserveState->stopListen();
     heatPump->coapPostPower->stopListen();
     heatPump->coapPostMode->stopListen();
     heatPump->coapPostTarget->stopListen();
     heatPump->coapPostPairingButton->stopListen();
+    heatPump->removeAllObservers();
 }
 
 void heat_pump_coap_send_bad_request(NabtoDeviceCoapRequest* request)
@@ -74,12 +82,24 @@ void heat_pump_coap_send_ok(NabtoDeviceCoapRequest* request, uint16_t code)
      nabto_device_coap_request_free(request);
 }
 
+// return true if the connection is within the coap connection limit, see CoapConnectionLimit
+bool heat_pump_coap_check_admitted(HeatPump* application, NabtoDeviceCoapRequest* request)
+{
+    if (!application->isAdmitted(nabto_device_coap_request_get_connection_ref(request))) {
+        nabto_device_coap_error_response(request, 503, "Too many connections");
+        nabto_device_coap_request_free(request);
+        return false;
+    }
+    return true;
+}
+
 // return true if action was allowed
-bool heat_pump_coap_check_action(NabtoDevice* device, NabtoDeviceCoapRequest* request, const char* action)
+bool heat_pump_coap_check_action(HeatPump* application, NabtoDeviceCoapRequest* request, const char* action)
 {
-    NabtoDeviceError effect = nabto_device_iam_check_action_attributes(
-        device,
-        nabto_device_coap_request_get_connection_ref(request), action, NULL, 0);
+    if (!heat_pump_coap_check_admitted(application, request)) {
+        return false;
+    }
+    NabtoDeviceError effect = application->checkAction(nabto_device_coap_request_get_connection_ref(request), action);
 
     if (effect != NABTO_DEVICE_EC_OK) {
         nabto_device_coap_error_response(request, 403, "Unauthorized");
@@ -176,6 +196,8 @@ bool pairUser( HeatPump* application, const std::string& fingerprint)
         return false;
     }
     std::cout << "Added the fingerprint " << fingerprint << " to the user " << userName << " with the role " << role<< std::endl;
+    // Compile the new user now instead of on the next access check.
+    application->reloadIam();
     return true;
 }
 
@@ -230,6 +252,9 @@ void questionHandler(NabtoDeviceCoapRequest* request, HeatPump* application, boo
 void heat_pump_pairing_button(NabtoDeviceCoapRequest* request, void* userData)
 {
     HeatPump* application = (HeatPump*)userData;
+    if (!heat_pump_coap_check_admitted(application, request)) {
+        return;
+    }
 
     size_t userCount;
     NabtoDeviceError ec = application->userCount(userCount);
@@ -239,14 +264,12 @@ void heat_pump_pairing_button(NabtoDeviceCoapRequest* request, void* userData)
         return;
     }
 
-    json attributes;
-    attributes["Pairing:UserCount"] = userCount;
-
-    std::vector<uint8_t> cbor = json::to_cbor(attributes);
+    nabto::common::CompiledIam::Attribute attributes[] = {
+        nabto::common::CompiledIam::Attribute(application->pairingUserCountAttribute, (double)userCount)
+    };
 
-    NabtoDeviceError effect = nabto_device_iam_check_action_attributes(
-        application->getDevice(),
-        nabto_device_coap_request_get_connection_ref(request), "Pairing:Button", cbor.data(), cbor.size());
+    NabtoDeviceError effect = application->checkAction(
+        nabto_device_coap_request_get_connection_ref(request), application->pairingButtonAction, attributes, 1);
 
     if (effect != NABTO_DEVICE_EC_OK) {
         nabto_device_coap_error_response(request, 403, "Unauthorized");
@@ -269,7 +292,7 @@ void heat_pump_set_power(NabtoDeviceCoapRequest* request, void* userData)
 {
     HeatPump* application = (HeatPump*)userData;
 
-    if (!heat_pump_coap_check_action(application->getDevice(), request, "HeatPump:Set")) {
+    if (!heat_pump_coap_check_action(application, request, "HeatPump:Set")) {
         return;
     }
 
@@ -296,7 +319,7 @@ void heat_pump_set_power(NabtoDeviceCoapRequest* request, void* userData)
 void heat_pump_set_mode(NabtoDeviceCoapRequest* request, void* userData)
 {
     HeatPump* application = (HeatPump*)userData;
-    if (!heat_pump_coap_check_action(application->getDevice(), request, "HeatPump:Set")) {
+    if (!heat_pump_coap_check_action(application, request, "HeatPump:Set")) {
         return;
     }
 
@@ -336,7 +359,7 @@ void heat_pump_set_mode(NabtoDeviceCoapRequest* request, void* userData)
 void heat_pump_set_target(NabtoDeviceCoapRequest* request, void* userData)
 {
     HeatPump* application = (HeatPump*)userData;
-    if (!heat_pump_coap_check_action(application->getDevice(), request, "HeatPump:Set")) {
+    if (!heat_pump_coap_check_action(application, request, "HeatPump:Set")) {
         return;
     }
 
@@ -363,7 +386,7 @@ void heat_pump_set_target(NabtoDeviceCoapRequest* request, void* userData)
 void heat_pump_get(NabtoDeviceCoapRequest* request, void* userData)
 {
     HeatPump* application = (HeatPump*)userData;
-    if (!heat_pump_coap_check_action(application->getDevice(), request, "HeatPump:Get")) {
+    if (!heat_pump_coap_check_action(application, request, "HeatPump:Get")) {
         return;
     }
 
@@ -379,3 +402,65 @@ void heat_pump_get(NabtoDeviceCoapRequest* request, void* userData)
     }
     nabto_device_coap_request_free(request);
 }
+
+void heat_pump_coap_send_observed_state(NabtoDeviceCoapRequest* request, uint64_t version, const json& state)
+{
+    json root;
+    root["Version"] = version;
+    root["State"] = state;
+    auto d = json::to_cbor(root);
+
+    nabto_device_coap_response_set_code(request, 205);
+    nabto_device_coap_response_set_content_format(request, NABTO_DEVICE_COAP_CONTENT_FORMAT_APPLICATION_CBOR);
+    NabtoDeviceError ec = nabto_device_coap_response_set_payload(request, d.data(), d.size());
+    if (ec != NABTO_DEVICE_EC_OK) {
+        nabto_device_coap_error_response(request, 500, "Insufficient resources");
+    } else {
+        nabto_device_coap_response_ready(request);
+    }
+    nabto_device_coap_request_free(request);
+}
+
+void heat_pump_coap_send_not_modified(NabtoDeviceCoapRequest* request)
+{
+    nabto_device_coap_response_set_code(request, 203);
+    nabto_device_coap_response_ready(request);
+    nabto_device_coap_request_free(request);
+}
+
+// Observe heat_pump state
+// CoAP GET /heat-pump/observe/{version}
+//
+// Responds with {"Version": n, "State": {...}} as soon as the state
+// version differs from the given version. Until then the request is
+// held by the device, so a client watching the state costs one
+// request per change instead of one request per poll. A request which
+// is held for 20 seconds without a change is answered with 2.03 not
+// modified and should be sent again with the same version.
+void heat_pump_observe(NabtoDeviceCoapRequest* request, void* userData)
+{
+    HeatPump* application = (HeatPump*)userData;
+    if (!heat_pump_coap_check_action(application, request, "HeatPump:Get")) {
+        return;
+    }
+
+    const char* versionString = nabto_device_coap_request_get_parameter(request, "version");
+    if (versionString == NULL) {
+        return heat_pump_coap_send_bad_request(request);
+    }
+    char* end;
+    uint64_t knownVersion = strtoull(versionString, &end, 10);
+    if (*end != 0) {
+        return heat_pump_coap_send_bad_request(request);
+    }
+
+    uint64_t version;
+    json state;
+    HeatPump::ObserveResult result = application->addObserver(request, knownVersion, version, state);
+    if (result == HeatPump::ObserveResult::CHANGED) {
+        heat_pump_coap_send_observed_state(request, version, state);
+    } else if (result == HeatPump::ObserveResult::FULL) {
+        nabto_device_coap_error_response(request, 503, "Too many observers");
+        nabto_device_coap_request_free(request);
+    }
+}
@@ -8,4 +8,7 @@
 void heat_pump_coap_init(NabtoDevice* device, HeatPump* heatpump);
 void heat_pump_coap_deinit(HeatPump* heatPump);
 
+void heat_pump_coap_send_observed_state(NabtoDeviceCoapRequest* request, uint64_t version, const json& state);
+void heat_pump_coap_send_not_modified(NabtoDeviceCoapRequest* request);
+
 #endif
@@ -0,0 +1,147 @@
+#include "framed_echo.hpp"
+
+#include "message_stream.hpp"
+
+#include <memory>
+
+class FramedEcho::EchoStream {
+ public:
+    EchoStream(FramedEcho* echo, NabtoDevice* device, NabtoDeviceStream* stream)
+        : echo_(echo), device_(device), stream_(stream)
+    {
+        controlFuture_ = nabto_device_future_new(device);
+    }
+
+    ~EchoStream()
+    {
+        // the message stream frees its futures before the stream is freed.
+        messageStream_.reset();
+        nabto_device_future_free(controlFuture_);
+        nabto_device_stream_free(stream_);
+    }
+
+    void start()
+    {
+        if (!controlFuture_) {
+            echo_->removeStream(this);
+            return;
+        }
+        nabto_device_stream_accept(stream_, controlFuture_);
+        nabto_device_future_set_callback(controlFuture_, &EchoStream::accepted, this);
+    }
+
+    void abort()
+    {
+        nabto_device_stream_abort(stream_);
+    }
+
+ private:
+    static void accepted(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+    {
+        EchoStream* self = (EchoStream*)userData;
+        if (ec != NABTO_DEVICE_EC_OK) {
+            self->echo_->removeStream(self);
+            return;
+        }
+        self->messageStream_.reset(new nabto::common::MessageStream(self->device_, self->stream_));
+        nabto::common::MessageStream* messageStream = self->messageStream_.get();
+        messageStream->start(
+            [messageStream](const uint8_t* message, size_t messageLength) {
+                messageStream->send(message, messageLength);
+            },
+            [self](NabtoDeviceError ec) {
+                // The message stream is still inside its callback, it
+                // is freed when the close has completed.
+                nabto_device_stream_close(self->stream_, self->controlFuture_);
+                nabto_device_future_set_callback(self->controlFuture_, &EchoStream::closed, self);
+            });
+    }
+
+    static void closed(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+    {
+        EchoStream* self = (EchoStream*)userData;
+        self->echo_->removeStream(self);
+    }
+
+    FramedEcho* echo_;
+    NabtoDevice* device_;
+    NabtoDeviceStream* stream_;
+    NabtoDeviceFuture* controlFuture_;
+    std::unique_ptr<nabto::common::MessageStream> messageStream_;
+};
+
+FramedEcho::FramedEcho(NabtoDevice* device)
+    : device_(device)
+{
+}
+
+FramedEcho::~FramedEcho()
+{
+    // Streams which were still closing when the device was stopped.
+    for (auto stream : streams_) {
+        delete stream;
+    }
+    if (listenerFuture_) {
+        nabto_device_future_free(listenerFuture_);
+    }
+    if (listener_) {
+        nabto_device_listener_free(listener_);
+    }
+}
+
+NabtoDeviceError FramedEcho::start(uint32_t port)
+{
+    listener_ = nabto_device_listener_new(device_);
+    listenerFuture_ = nabto_device_future_new(device_);
+    if (listener_ == NULL || listenerFuture_ == NULL) {
+        return NABTO_DEVICE_EC_OUT_OF_MEMORY;
+    }
+    NabtoDeviceError ec = nabto_device_stream_init_listener(device_, listener_, port);
+    if (ec) {
+        return ec;
+    }
+    startListen();
+    return NABTO_DEVICE_EC_OK;
+}
+
+void FramedEcho::stop()
+{
+    if (listener_ != NULL) {
+        nabto_device_listener_stop(listener_);
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto stream : streams_) {
+        stream->abort();
+    }
+}
+
+void FramedEcho::startListen()
+{
+    nabto_device_listener_new_stream(listener_, listenerFuture_, &newStream_);
+    nabto_device_future_set_callback(listenerFuture_, &FramedEcho::newStream, this);
+}
+
+void FramedEcho::newStream(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+{
+    FramedEcho* self = (FramedEcho*)userData;
+    if (ec != NABTO_DEVICE_EC_OK) {
+        return;
+    }
+    EchoStream* stream = new EchoStream(self, self->device_, self->newStream_);
+    self->newStream_ = NULL;
+    {
+        std::unique_lock<std::mutex> lock(self->mutex_);
+        self->streams_.insert(stream);
+    }
+    stream->start();
+    self->startListen();
+}
+
+void FramedEcho::removeStream(EchoStream* stream)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        streams_.erase(stream);
+    }
+    delete stream;
+}
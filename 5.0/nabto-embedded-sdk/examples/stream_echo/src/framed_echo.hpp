@@ -0,0 +1,45 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+
+#include <mutex>
+#include <set>
+
+/**
+ * Echo of length framed messages, see MessageStream. Each received
+ * message is sent back as one message. Used by stream_echo_client
+ * when it is given a message deadline.
+ */
+class FramedEcho {
+ public:
+    FramedEcho(NabtoDevice* device);
+
+    /**
+     * Frees streams which did not finish closing, destroy after
+     * nabto_device_stop.
+     */
+    ~FramedEcho();
+
+    NabtoDeviceError start(uint32_t port);
+
+    /**
+     * Stop listening and abort all streams. Call before the device is
+     * closed.
+     */
+    void stop();
+
+ private:
+    class EchoStream;
+
+    void startListen();
+    static void newStream(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData);
+    void removeStream(EchoStream* stream);
+
+    NabtoDevice* device_;
+    NabtoDeviceListener* listener_ = NULL;
+    NabtoDeviceFuture* listenerFuture_ = NULL;
+    NabtoDeviceStream* newStream_ = NULL;
+
+    std::mutex mutex_;
+    std::set<EchoStream*> streams_;
+};
@@ -0,0 +1,269 @@
+#include "stream_bench.hpp"
+
+#include <nabto/nabto_device_experimental.h>
+
+static const size_t HEADER_SIZE = 5;
+static const size_t MAX_CHUNK_SIZE = 65536;
+
+class StreamBench::BenchStream {
+ public:
+    BenchStream(StreamBench* bench, NabtoDevice* device, NabtoDeviceStream* stream)
+        : bench_(bench), stream_(stream)
+    {
+        controlFuture_ = nabto_device_future_new(device);
+        readFuture_ = nabto_device_future_new(device);
+        writeFuture_ = nabto_device_future_new(device);
+    }
+
+    ~BenchStream()
+    {
+        nabto_device_future_free(controlFuture_);
+        nabto_device_future_free(readFuture_);
+        nabto_device_future_free(writeFuture_);
+        nabto_device_stream_free(stream_);
+    }
+
+    void start()
+    {
+        if (!controlFuture_ || !readFuture_ || !writeFuture_) {
+            bench_->removeStream(this);
+            return;
+        }
+        nabto_device_stream_accept(stream_, controlFuture_);
+        nabto_device_future_set_callback(controlFuture_, &BenchStream::accepted, this);
+    }
+
+    void abort()
+    {
+        nabto_device_stream_abort(stream_);
+    }
+
+ private:
+    static void accepted(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+    {
+        BenchStream* self = (BenchStream*)userData;
+        if (ec != NABTO_DEVICE_EC_OK) {
+            self->bench_->removeStream(self);
+            return;
+        }
+        nabto_device_stream_read_all(self->stream_, self->readFuture_, self->header_, HEADER_SIZE, &self->readLength_);
+        nabto_device_future_set_callback(self->readFuture_, &BenchStream::headerRead, self);
+    }
+
+    static void headerRead(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+    {
+        BenchStream* self = (BenchStream*)userData;
+        if (ec != NABTO_DEVICE_EC_OK) {
+            self->bench_->removeStream(self);
+            return;
+        }
+        self->mode_ = self->header_[0];
+        size_t chunkSize = ((size_t)self->header_[1] << 24) | ((size_t)self->header_[2] << 16) | ((size_t)self->header_[3] << 8) | (size_t)self->header_[4];
+        bool validMode = self->mode_ == 'u' || self->mode_ == 'd' || self->mode_ == 'b' || self->mode_ == 'e';
+        if (!validMode || chunkSize == 0 || chunkSize > MAX_CHUNK_SIZE) {
+            self->abort();
+            self->bench_->removeStream(self);
+            return;
+        }
+        self->readBuffer_.resize(chunkSize);
+        self->reading_ = true;
+        if (self->mode_ == 'd' || self->mode_ == 'b') {
+            self->writeBuffer_.resize(chunkSize);
+            for (size_t i = 0; i < chunkSize; i++) {
+                self->writeBuffer_[i] = (uint8_t)i;
+            }
+            self->writing_ = true;
+            self->startWrite();
+        }
+        self->startRead();
+    }
+
+    void startRead()
+    {
+        nabto_device_stream_read_some(stream_, readFuture_, readBuffer_.data(), readBuffer_.size(), &readLength_);
+        nabto_device_future_set_callback(readFuture_, &BenchStream::hasRead, this);
+    }
+
+    static void hasRead(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+    {
+        BenchStream* self = (BenchStream*)userData;
+        if (ec != NABTO_DEVICE_EC_OK) {
+            {
+                std::unique_lock<std::mutex> lock(self->mutex_);
+                self->reading_ = false;
+                if (ec != NABTO_DEVICE_EC_EOF) {
+                    self->failed_ = true;
+                }
+            }
+            if (ec != NABTO_DEVICE_EC_EOF) {
+                self->abort();
+            }
+            self->maybeFinish();
+            return;
+        }
+        if (self->mode_ == 'e') {
+            nabto_device_stream_write(self->stream_, self->writeFuture_, self->readBuffer_.data(), self->readLength_);
+            nabto_device_future_set_callback(self->writeFuture_, &BenchStream::echoed, self);
+            return;
+        }
+        self->startRead();
+    }
+
+    static void echoed(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+    {
+        BenchStream* self = (BenchStream*)userData;
+        if (ec != NABTO_DEVICE_EC_OK) {
+            {
+                std::unique_lock<std::mutex> lock(self->mutex_);
+                self->reading_ = false;
+                self->failed_ = true;
+            }
+            self->abort();
+            self->maybeFinish();
+            return;
+        }
+        self->startRead();
+    }
+
+    void startWrite()
+    {
+        nabto_device_stream_write(stream_, writeFuture_, writeBuffer_.data(), writeBuffer_.size());
+        nabto_device_future_set_callback(writeFuture_, &BenchStream::written, this);
+    }
+
+    static void written(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+    {
+        BenchStream* self = (BenchStream*)userData;
+        {
+            std::unique_lock<std::mutex> lock(self->mutex_);
+            if (ec != NABTO_DEVICE_EC_OK) {
+                self->failed_ = true;
+            }
+            // The client closes its side when the test is over.
+            if (ec == NABTO_DEVICE_EC_OK && self->reading_) {
+                lock.unlock();
+                self->startWrite();
+                return;
+            }
+            self->writing_ = false;
+        }
+        self->maybeFinish();
+    }
+
+    void maybeFinish()
+    {
+        bool failed;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (reading_ || writing_) {
+                return;
+            }
+            failed = failed_;
+        }
+        if (failed) {
+            bench_->removeStream(this);
+            return;
+        }
+        nabto_device_stream_close(stream_, controlFuture_);
+        nabto_device_future_set_callback(controlFuture_, &BenchStream::closed, this);
+    }
+
+    static void closed(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+    {
+        BenchStream* self = (BenchStream*)userData;
+        self->bench_->removeStream(self);
+    }
+
+    StreamBench* bench_;
+    NabtoDeviceStream* stream_;
+    NabtoDeviceFuture* controlFuture_;
+    NabtoDeviceFuture* readFuture_;
+    NabtoDeviceFuture* writeFuture_;
+
+    uint8_t header_[HEADER_SIZE];
+    uint8_t mode_ = 0;
+    std::vector<uint8_t> readBuffer_;
+    size_t readLength_ = 0;
+    std::vector<uint8_t> writeBuffer_;
+
+    std::mutex mutex_;
+    bool reading_ = false;
+    bool writing_ = false;
+    bool failed_ = false;
+};
+
+StreamBench::StreamBench(NabtoDevice* device)
+    : device_(device)
+{
+}
+
+StreamBench::~StreamBench()
+{
+    // Streams which were still closing when the device was stopped.
+    for (auto stream : streams_) {
+        delete stream;
+    }
+    if (listenerFuture_) {
+        nabto_device_future_free(listenerFuture_);
+    }
+    if (listener_) {
+        nabto_device_listener_free(listener_);
+    }
+}
+
+NabtoDeviceError StreamBench::start(uint32_t port)
+{
+    listener_ = nabto_device_listener_new(device_);
+    listenerFuture_ = nabto_device_future_new(device_);
+    if (listener_ == NULL || listenerFuture_ == NULL) {
+        return NABTO_DEVICE_EC_OUT_OF_MEMORY;
+    }
+    NabtoDeviceError ec = nabto_device_stream_init_listener(device_, listener_, port);
+    if (ec) {
+        return ec;
+    }
+    startListen();
+    return NABTO_DEVICE_EC_OK;
+}
+
+void StreamBench::stop()
+{
+    if (listener_ != NULL) {
+        nabto_device_listener_stop(listener_);
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto stream : streams_) {
+        stream->abort();
+    }
+}
+
+void StreamBench::startListen()
+{
+    nabto_device_listener_new_stream(listener_, listenerFuture_, &newStream_);
+    nabto_device_future_set_callback(listenerFuture_, &StreamBench::newStream, this);
+}
+
+void StreamBench::newStream(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
+{
+    StreamBench* self = (StreamBench*)userData;
+    if (ec != NABTO_DEVICE_EC_OK) {
+        return;
+    }
+    BenchStream* stream = new BenchStream(self, self->device_, self->newStream_);
+    self->newStream_ = NULL;
+    {
+        std::unique_lock<std::mutex> lock(self->mutex_);
+        self->streams_.insert(stream);
+    }
+    stream->start();
+    self->startListen();
+}
+
+void StreamBench::removeStream(BenchStream* stream)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        streams_.erase(stream);
+    }
+    delete stream;
+}
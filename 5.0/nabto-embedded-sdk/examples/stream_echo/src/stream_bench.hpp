@@ -0,0 +1,55 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+
+#include <mutex>
+#include <set>
+#include <vector>
+
+/**
+ * Device side of the stream_bench_client throughput test.
+ *
+ * The client starts each stream with a 5 byte header, a mode byte
+ * followed by a 4 byte big endian chunk size, at most 65536.
+ *
+ *   'u' upload,   received data is discarded.
+ *   'd' download, chunks are written until the client closes its side.
+ *   'b' both,     upload and download at the same time.
+ *   'e' echo,     received data is written back.
+ *
+ * The device closes a stream when it has read EOF and its writes have
+ * stopped.
+ */
+class StreamBench {
+ public:
+    StreamBench(NabtoDevice* device);
+
+    /**
+     * Frees streams which did not finish closing, destroy after
+     * nabto_device_stop.
+     */
+    ~StreamBench();
+
+    NabtoDeviceError start(uint32_t port);
+
+    /**
+     * Stop listening and abort all streams. Call before the device is
+     * closed.
+     */
+    void stop();
+
+ private:
+    class BenchStream;
+
+    void startListen();
+    static void newStream(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData);
+    void removeStream(BenchStream* stream);
+
+    NabtoDevice* device_;
+    NabtoDeviceListener* listener_ = NULL;
+    NabtoDeviceFuture* listenerFuture_ = NULL;
+    NabtoDeviceStream* newStream_ = NULL;
+
+    std::mutex mutex_;
+    std::set<BenchStream*> streams_;
+};
@@ -2,8 +2,12 @@
 #include <nabto/nabto_device_experimental.h>
 
 #include "json_config.hpp"
+#include "log_filter.hpp"
+#include "stream_bench.hpp"
+#include "framed_echo.hpp"
 
 #include <iostream>
+#include <memory>
 #include <cxxopts.hpp>
 
 #include <signal.h>
@@ -15,6 +19,9 @@ static bool init_stream_echo(const std::string& configFile, const std::string& p
 static void run_stream_echo(const std::string& configFile, const std::string& logLevel);
 
 
+// The log callback is invoked until the device is freed.
+static nabto::common::DeviceLogFilter logFilter;
+
 static NabtoDeviceError allow_anyone_to_connect(NabtoDeviceConnectionRef connectionReference, const char* action, void* attributes, size_t attributesLength, void* userData);
 
 // stream echo handlers
@@ -55,7 +62,7 @@ int main(int argc, char** argv)
         ("h,help", "Show help")
         ("i,init", "Write configuration to the config file and create a a private key")
         ("c,config", "Config file to write to", cxxopts::value<std::string>()->default_value("stream_echo_device.json"))
-        ("log-level", "Log level to log (error|info|trace|debug)", cxxopts::value<std::string>()->default_value("info"));
+        ("log-level", "Log level to log (error|warn|info|trace|debug), per module levels can be given as e.g. error,stream=trace,dtls=info", cxxopts::value<std::string>()->default_value("info"));
 
     options.add_options("Init Parameters")
         ("p,product", "Product id", cxxopts::value<std::string>())
@@ -196,14 +203,10 @@ void run_stream_echo(const std::string& configFile, const std::string& logLevel)
         std::cerr << "Failed to enable mdns" << std::endl;
     }
 
-    ec = nabto_device_set_log_level(device, logLevel.c_str());
+    ec = logFilter.apply(device, logLevel);
     if (ec) {
         std::cerr << "Failed to set loglevel" << std::endl;
     }
-    ec = nabto_device_set_log_std_out_callback(device);
-    if (ec) {
-        std::cerr << "Failed to enable stdour logging" << std::endl;
-    }
 
     ec = nabto_device_iam_override_check_access_implementation(device, allow_anyone_to_connect, NULL);
     if (ec) {
@@ -245,6 +248,20 @@ void run_stream_echo(const std::string& configFile, const std::string& logLevel)
 
     startListenForEchoStream(device);
 
+    // framed messages from stream_echo_client --message-deadline
+    std::unique_ptr<FramedEcho> framedEcho(new FramedEcho(device));
+    ec = framedEcho->start(44);
+    if (ec) {
+        std::cerr << "could not listen for framed echo streams" << std::endl;
+    }
+
+    // streams for stream_bench_client
+    std::unique_ptr<StreamBench> bench(new StreamBench(device));
+    ec = bench->start(43);
+    if (ec) {
+        std::cerr << "could not listen for benchmark streams" << std::endl;
+    }
+
     // Wait for the user to press Ctrl-C
 
     struct sigaction sigIntHandler;
@@ -279,6 +296,8 @@ void run_stream_echo(const std::string& configFile, const std::string& logLevel)
         iterator = iterator->next;
         nabto_device_stream_abort(current->stream);
     }
+    bench->stop();
+    framedEcho->stop();
     // nabto_device_stop will block until all internal events are handled. Since nabto_device_listener_stop and nabto_device_stream_abort has triggered events, these will be resolved before free actually occurs.
 
     NabtoDeviceFuture* fut = nabto_device_future_new(device);
@@ -289,6 +308,8 @@ void run_stream_echo(const std::string& configFile, const std::string& logLevel)
     nabto_device_stop(device);
     nabto_device_future_free(listenerFuture);
     nabto_device_listener_free(listener);
+    bench.reset();
+    framedEcho.reset();
     nabto_device_free(device);
     return;
 }
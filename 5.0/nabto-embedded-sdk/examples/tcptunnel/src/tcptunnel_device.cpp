@@ -1,5 +1,6 @@
 #include "tcptunnel.hpp"
 #include "json_config.hpp"
+#include "log_filter.hpp"
 
 #include <nabto/nabto_device.h>
 #include <nabto/nabto_device_experimental.h>
@@ -17,6 +18,9 @@ static bool run_tcptunnel(const std::string& configFile, const std::string& logL
 
 static std::string randomString(size_t n);
 
+// The log callback is invoked until the device is freed.
+static nabto::common::DeviceLogFilter logFilter;
+
 void my_handler(int s){
 }
 
@@ -29,7 +33,7 @@ int main(int argc, char** argv)
         ("version", "Show version")
         ("i,init", "Initialize configuration file")
         ("c,config", "Configuration file", cxxopts::value<std::string>()->default_value("tcptunnel_device.json"))
-        ("log-level", "Log level to log (error|info|trace|debug)", cxxopts::value<std::string>()->default_value("error"));
+        ("log-level", "Log level to log (error|warn|info|trace|debug), per module levels can be given as e.g. error,stream=trace,dtls=info", cxxopts::value<std::string>()->default_value("error"));
      options.add_options("Init Parameters")
         ("p,product", "Product id", cxxopts::value<std::string>())
         ("d,device", "Device id", cxxopts::value<std::string>())
@@ -267,16 +271,11 @@ bool run_tcptunnel(const std::string& configFile, const std::string& logLevel)
         std::cerr << "Failed to enable tcp tunnelling" << std::endl;
         return false;
     }
-    ec = nabto_device_set_log_level(device, logLevel.c_str());
+    ec = logFilter.apply(device, logLevel);
     if (ec) {
         std::cerr << "Failed to set loglevel" << std::endl;
         return false;
     }
-    ec = nabto_device_set_log_std_out_callback(device);
-    if (ec) {
-        std::cerr << "Failed to enable stdour logging" << std::endl;
-        return false;
-    }
 
     try {
         auto serverPort = config["ServerPort"].get<uint16_t>();